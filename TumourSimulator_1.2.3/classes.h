@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <math.h>
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define SQR(x) (x)*(x)
 #define SWAPD(x, y) tempd = (x); (x) = (y); (y) = tempd
 #define SWAP(x, y) temp = (x); (x) = (y); (y) = temp
@@ -39,8 +40,7 @@
 #include <vector>
 using namespace std;
 
-double _drand48(void) ;
-void _srand48(int a) ;
+#include "rng.h"
 void err(char *reason) ;
 void err(char *reason, int a) ;
 void err(char *reason, double a);
@@ -50,8 +50,10 @@ int main_proc(int exit_size, int save_size, double max_time, double wait_time) ;
 void end() ;
 void reset() ;
 void save_data() ;
-void save_spatial(int *) ;
-void save_snps(char *name,int *n, int total, int mode, int *) ;
+void bench_overlap() ;
+void bench_rng() ;
+void save_spatial() ;
+void save_snps(char *name, int total, int mode, int *, unsigned int flag) ;
 float average_distance_ij() ;
 
 extern int L ;
@@ -67,6 +69,7 @@ typedef unsigned char BYTE ;
 #else // assume otherwise the program is compiled under Windows
 #include <windows.h>
 #endif
+typedef unsigned long long int QWORD ;
 
 class vecd  // class of 3d vectors
 {
@@ -93,10 +96,12 @@ public:
 	}
 	inline vecd operator*= (double S) {
 		x*=S ; y*=S ; z*=S ;
+		return *this ;
 	}
 	inline vecd operator/= (double S) {
     double S2=1./S ;
     x*=S2 ; y*=S2 ; z*=S2 ;
+    return *this ;
 	}
 };
 
@@ -139,18 +144,50 @@ class IVec  // class of 3d integer vectors
 	inline void operator+= ( const IVec& V2 ) { i += V2.i; j += V2.j; k += V2.k; }
 };
 
-struct Cell {
 #ifdef MANY_LESIONS
 #warning compiled with MANY_LESIONS switched on - do this only if M>1e-5, otherwise it will take extra memory
-  unsigned int lesion ;
+typedef unsigned int lesion_t ;
 #else
-  short unsigned int lesion ;
+typedef short unsigned int lesion_t ;
 #endif
-  short int x,y,z ;
-  unsigned int gen ; 
+typedef unsigned int gen_t ;
+typedef short int coord_t ;
+
+struct Cell {
+  lesion_t lesion ;
+  coord_t x,y,z ;
+  gen_t gen ; 
+};
+
+// Cells are stored column-wise. The indices read to find a cell's rates (genotype and lesion) are kept
+// together in one array and the coordinates in another, packed so that a cell takes 6+6 bytes
+// (8+6 with MANY_LESIONS). cells[i] returns a reference to the cell which can be used like Cell&.
+#pragma pack(push,2)
+struct CellKey { gen_t gen ; lesion_t lesion ; } ;
+struct CellPos { coord_t x,y,z ; } ;
+#pragma pack(pop)
+
+struct CellRef {
+  gen_t &gen ; lesion_t &lesion ; coord_t &x, &y, &z ;
+  CellRef(CellKey &k, CellPos &p) : gen(k.gen), lesion(k.lesion), x(p.x), y(p.y), z(p.z) { }
+  inline CellRef &operator=(const CellRef &c) { gen=c.gen ; lesion=c.lesion ; x=c.x ; y=c.y ; z=c.z ; return *this ; }
+};
+
+class CellStore {
+  public:
+    vector <CellKey> key ;
+    vector <CellPos> pos ;
+    inline CellRef operator[](int i) { return CellRef(key[i],pos[i]) ; }
+    inline size_t size() { return key.size() ; }
+    inline void push_back(const Cell &c) {
+      CellKey k ; k.gen=c.gen ; k.lesion=c.lesion ; key.push_back(k) ;
+      CellPos p ; p.x=c.x ; p.y=c.y ; p.z=c.z ; pos.push_back(p) ;
+    }
+    inline void pop_back() { key.pop_back() ; pos.pop_back() ; }
+    void clear() { key.clear() ; pos.clear() ; }
+    static int bytes_per_cell() { return sizeof(CellKey)+sizeof(CellPos) ; }
 };
 
-#ifndef PUSHING
 class Sites {
   public:
     DWORD *s ;
@@ -160,50 +197,68 @@ class Sites {
     inline void unset(const unsigned int i) { s[(i>>5)]&=~(1<<(i&31)) ; }
     inline int is_set(const unsigned int i) { return (s[(i>>5)]>>(i&31))&1 ; }
 };
-#else
-typedef int Sites ;
+
+#ifndef PUSHING
+#include "lattice.h"
 #endif
 
-extern vector <Cell> cells ;
+extern CellStore cells ;
+
+class RadiusHist { // no. of occupied sites of a lesion at each squared distance from its centre
+  public:
+    vector <int> h ;
+    int max ; // largest squared distance with h[max]>0
+    RadiusHist() { max=0 ; }
+    inline void add(int r2) { 
+      if (r2>=h.size()) h.resize(r2+1+r2/2,0) ; 
+      h[r2]++ ; if (r2>max) max=r2 ; 
+    }
+    inline void remove(int r2) { 
+      h[r2]-- ; 
+      while (max>0 && h[max]==0) max-- ; 
+    }
+};
 
 #ifndef PUSHING
 struct Lesion {
-  int wx ; 
+  int wx ; // the lattice has no edge, (wx/2,wx/2,wx/2) is just the lattice position of the centre
   vecd r,rold,rinit ; 
   double rad, rad0 ;
   int n,n0 ; 
-  vector <int> closest ;
-  Sites **p ;
+  int id, slot ; // id is the index in lesions[] and never changes, slot is the position in lesion_list
+  int glev, gbuck, gpos, gdirty ; // level, bucket and position in the bucket in lesion_grid, gdirty=1 if it needs updating
+  vector <int> closest ; // ids of nearby lesions
+  vector <int> near ; // ids of lesions which have this one in their closest list
+  Lattice p ; // occupied sites, and the cells occupying them if Lattice::index is set
+  RadiusHist rh ; // occupied sites by squared distance from the centre
   static int nl ;
   static double maxdisp ;
-  Lesion(int cellno, int g, int x0, int y0, int z0) {
-    // cellno is not used anywhere in this version of the method
+  Lesion(int id0, int cellno, int g, int x0, int y0, int z0) : wx(8), p(wx/2) {
+    // cellno is used only when Lattice::index is set
     rad=rad0=1 ; 
     r=vecd(x0,y0,z0) ; rinit=rold=r ;
     closest.clear() ;
-    wx=4 ; p=new Sites*[wx*wx] ;
-    int i,j,k;
-    for (i=0;i<wx*wx;i++) {
-      p[i]=new Sites(wx) ;
-    }
-    Cell c ; c.x=c.y=c.z=0 ; c.gen=g ; c.lesion=nl++ ; 
+    Cell c ; c.x=c.y=c.z=0 ; c.gen=g ; c.lesion=id=id0 ; slot=-1 ; nl++ ; 
 #ifdef MANY_LESIONS
     if (nl>2000000000) err ("nl>2000000000") ;    
 #else
     if (nl>32000) err ("nl>32000") ;
 #endif
-    p[(wx/2)*wx+wx/2]->set(wx/2) ;
+    occupy(wx/2,wx/2,wx/2) ;
+    if (Lattice::index) p.cell(wx/2,wx/2,wx/2)=cellno ;
     cells.push_back(c) ; volume++ ; n=n0=1 ; 
   }  
   ~Lesion() {
     nl-- ; 
-    for (int i=0;i<wx*wx;i++) delete p[i] ;
-    delete [] p ;    
   }
-  void update_wx() ;
+  inline int &cell(int i, int j, int k) { return p.cell(k,j,i) ; } // only for an occupied site
+  long long int lists_bytes() { return (closest.capacity()+near.capacity()+rh.h.capacity())*sizeof(int) ; } // heap part of the vectors
+  long long int bytes() { return sizeof(Lesion)+p.bytes()+lists_bytes() ; } // memory used by the lesion and its lattice
+  inline void occupy(int x, int y, int z) { p.set(x,y,z) ; rh.add(SQR(x-wx/2)+SQR(y-wx/2)+SQR(z-wx/2)) ; } // only for an empty site
+  inline void vacate(int x, int y, int z) { p.unset(x,y,z) ; rh.remove(SQR(x-wx/2)+SQR(y-wx/2)+SQR(z-wx/2)) ; } 
   void find_closest() ;
   void one_move_step() ;  
-  void reduce_overlap() ; 
+  int reduce_overlap() ; // returns the no. of sweeps
   int no_free_sites(int x, int y, int z);  
   void choose_nn(int &x, int &y, int &z);  
 };
@@ -213,68 +268,258 @@ struct Lesion {
   vecd r,rold,rinit ; 
   double rad, rad0 ;
   int n,n0 ; 
-  vector <int> closest ;
-  Sites ***p ;
+  int id, slot ; // id is the index in lesions[] and never changes, slot is the position in lesion_list
+  int glev, gbuck, gpos, gdirty ; // level, bucket and position in the bucket in lesion_grid, gdirty=1 if it needs updating
+  vector <int> closest ; // ids of nearby lesions
+  vector <int> near ; // ids of lesions which have this one in their closest list
+  int *p ; // index of the cell occupying each site of the wx^3 cube, -1 if none
+  BYTE *nocc ; // no. of occupied neighbours of each site
+  int nd[27] ; // flat offsets of the neighbours in the wx^3 cube
+  RadiusHist rh ; // occupied sites by squared distance from the centre
   static int nl ;
   static double maxdisp ;
-  Lesion(int cellno, int g, int x0, int y0, int z0) {
+  Lesion(int id0, int cellno, int g, int x0, int y0, int z0) {
     rad=rad0=1 ; 
     r=vecd(x0,y0,z0) ; rinit=rold=r ;
     closest.clear() ;
-    wx=16 ; p=new Sites**[wx] ;
-    int i,j,k;
-    for (i=0;i<wx;i++) {
-      p[i]=new Sites*[wx] ; if (p[i]==NULL) err("out of memory") ;
-      for (j=0;j<wx;j++) {
-        p[i][j]=new Sites[wx] ;
-        for (k=0;k<wx;k++) p[i][j][k]=-1 ;
-      }
-    }
-    Cell c ; c.x=c.y=c.z=0 ; c.gen=g ; c.lesion=nl++ ; 
+    wx=16 ; p=new int[wx*wx*wx] ; nocc=new BYTE[wx*wx*wx] ; if (p==NULL || nocc==NULL) err("out of memory") ;
+    for (int i=0;i<wx*wx*wx;i++) { p[i]=-1 ; nocc[i]=0 ; }
+    set_offsets() ;
+    Cell c ; c.x=c.y=c.z=0 ; c.gen=g ; c.lesion=id=id0 ; slot=-1 ; nl++ ; 
 #ifdef MANY_LESIONS
     if (nl>2000000000) err ("nl>2000000000") ;    
 #else
     if (nl>32000) err ("nl>32000") ;
 #endif    
-    p[wx/2][wx/2][wx/2]=cellno ;
+    set_cell(site(wx/2,wx/2,wx/2),cellno) ;
     cells.push_back(c) ; volume++ ; n=n0=1 ; 
   }  
   ~Lesion() {
     nl-- ; 
-    for (int i=0;i<wx;i++) {
-      for (int j=0;j<wx;j++) delete p[i][j] ;
-      delete [] p[i] ;
-    }
     delete [] p ;    
+    delete [] nocc ;
   }
+  inline int site(int i, int j, int k) { return (i*wx+j)*wx+k ; }
+  inline int &cell(int i, int j, int k) { return p[site(i,j,k)] ; }
+  inline int &cell(int s) { return p[s] ; }
+  long long int lists_bytes() { return (closest.capacity()+near.capacity()+rh.h.capacity())*sizeof(int) ; } // heap part of the vectors
+  long long int bytes() { return sizeof(Lesion)+(long long int)(wx*wx*wx)*(sizeof(int)+sizeof(BYTE))+lists_bytes() ; } // memory used by the lesion and its cube
+  inline int near_edge(int i, int j, int k) { return k<2 || k>=wx-3 || j<2 || j>=wx-3 || i<2 || i>=wx-3 ; } // occupied sites are kept 2 sites away from the edge of the cube
+  void set_offsets() ;
+  void set_cell(int s, int cellno) ;
   void update_wx() ;
   void find_closest() ;
   void one_move_step() ;  
-  void reduce_overlap() ; 
+  int reduce_overlap() ; // returns the no. of sweeps
   int no_free_sites(int x, int y, int z);  
-  void find_dir_min_drag(int i, int j, int k, int &in, int &jn, int &kn);       // find direction of least drag  
+  void find_dir_min_drag(int i, int j, int k, int &in, int &jn, int &kn, vector <IVec> *path=NULL);       // find direction of least drag  
 };
 #endif
 
+class LesionGrid { // broad phase for find_closest: lesion centres binned in uniform grids, one grid per range of radii
+  public:
+    static const int NLEV=20 ; // lesions in level l have rad<4<<l
+    vector < vector <int> > b[NLEV] ; // buckets of lesion ids, grid cells are hashed into them
+    int no[NLEV] ; // no. of lesions in each level
+    vector <int> dirty ; // ids of lesions which have moved or grown since the last query
+    LesionGrid() { clear() ; }
+    void clear() { for (int l=0;l<NLEV;l++) { b[l].clear() ; no[l]=0 ; } dirty.clear() ; }
+    inline static int level(double rad) { int l=0 ; while (l<NLEV-1 && rad>=(4<<l)) l++ ; return l ; }
+    inline static double width(int l) { return 16<<l ; } // grid cell size
+    inline static unsigned int hash(int x, int y, int z) { return x*73856093u ^ y*19349663u ^ z*83492791u ; }
+    inline int bucket(int l, vecd &r) { 
+      double w=width(l) ; 
+      return hash(int(floor(r.x/w)),int(floor(r.y/w)),int(floor(r.z/w)))&(b[l].size()-1) ; 
+    }
+    void rehash(int l) ;
+    void insert(Lesion *ls) ;
+    void remove(Lesion *ls) ;
+    void update(Lesion *ls) ; 
+    inline void moved(Lesion *ls) { if (!ls->gdirty) { ls->gdirty=1 ; dirty.push_back(ls->id) ; } } // call after r or rad of ls has changed
+    void query(Lesion *ls, vector <int> &c) ; // ids of all lesions which may be closest to ls, possibly repeated
+};
+
 const unsigned int RESISTANT_PM = 1<<31 ;
 const unsigned int DRIVER_PM = 1<<30 ;
 const unsigned int L_PM = (1<<30) - 1 ; 
 
-struct Genotype {
-  vector <unsigned int> sequence ;
+struct Genotype { // a node of the phylogeny: only the mutations acquired since mother_genotype are kept
+  unsigned int *snps ; int no_snps ; // new mutations, the full sequence is the mother's sequence followed by these
   BYTE no_resistant, no_drivers ;
 #ifdef COLORS
   DWORD color0 ;
 #endif
   float death[2], growth[2], m[2] ; // m = migration probability before/after treatment
   int number ; // number of cells of this genotype total/on the surface
-  int prev_gen ;
+  int clade ; // number of cells of this genotype and its descendants, i.e. of cells with each of its snps
+  int prev_gen ; // identifier of the mother genotype
   int index ; // this is set only when saving data
+  int refs ; // no. of daughter genotypes, +1 while in genotypes[]; the genotype is deleted by release() when it drops to 0
+  int length, depth ; // no. of mutations in the full sequence, no. of ancestors
   Genotype(void) ;
-  ~Genotype(void) { sequence.clear() ; }
-  Genotype(Genotype *mother, int prevg, int no_snp) ;
-	Genotype *mother_genotype;
-	int identifier;
+  ~Genotype(void) ;
+  Genotype(Genotype *mother, int no_snp) ;
+  static void *operator new(size_t s) ; // nodes are allocated from genotype_arena
+  static void operator delete(void *p) ;
+  void get_sequence(vector <unsigned int> &s) ; // the full sequence
+	Genotype *mother_genotype; // valid as long as this genotype exists, also when the mother is extinct
+	int identifier; // unique in a run, unlike the index in genotypes[] which is reused
+  int dfs ; // position in lca_index, valid only if lca_index.node[dfs]==this
+};
+
+class GenotypeArena { // slab allocator for Genotype nodes and their lists of mutations
+  public:
+    static const int SLAB=4096, SNP_SLAB=1<<16 ; // nodes per slab, mutations per slab
+    static const int MAX_FREE=64 ; // freed lists of mutations longer than this are reused only after clear()
+    vector <char*> slabs ; 
+    vector <unsigned int*> snp_slabs ; 
+    int used, snp_slab, snp_pos ; // nodes taken from slabs, current slab and position in snp_slabs 
+    void *node_list ; // freed nodes, linked through their first bytes
+    unsigned int *snp_lists[MAX_FREE+1] ; // freed lists of mutations of given length, linked the same way
+    int nodes, serial ; // nodes in use, identifiers given so far
+    GenotypeArena() { used=0 ; clear() ; }
+    ~GenotypeArena() { 
+      for (int i=0;i<slabs.size();i++) delete [] slabs[i] ; 
+      for (int i=0;i<snp_slabs.size();i++) delete [] snp_slabs[i] ; 
+    }
+    void *alloc_node() ;
+    inline void free_node(void *p) { *(void**)p=node_list ; node_list=p ; nodes-- ; }
+    unsigned int *alloc_snps(int n) ;
+    void free_snps(unsigned int *s, int n) ;
+    void clear() { // drops all nodes at once without destroying them, the slabs are kept for reuse
+      used=0 ; snp_slab=-1 ; snp_pos=SNP_SLAB ; node_list=NULL ; nodes=serial=0 ;
+      for (int i=0;i<=MAX_FREE;i++) snp_lists[i]=NULL ;
+    }
+};
+
+class MutationSampler { // no. of new mutations at a division and their kinds, init() it when gama or gama_res change
+  public:
+    Poisson number ; 
+    double p_driver, p_res ; // prob. that a new mutation is a driver (-1 if drivers are off), that a non-driver is resistant
+    double t_driver, t_res ; // the same as thresholds for a single uniform: driver below t_driver, resistant below t_res
+    double left ; // Exp(1) hazard left until the next draw with mutations, each draw uses up its mean
+    int skip ; // count down to draws with mutations, pays off when most draws are 0
+    void init() ;
+    void set_mean(double mu) { number.init(mu) ; skip=(mu<0.5) ; }
+    void restart() { if (rng_type!=R_DRAND48) left=-log(1-_drand48()) ; } // new skip, e.g. for a new stream
+    inline int no_snps() { // most draws only count down; P(no mutations in n draws)=exp(-n*mean) as for n Poisson draws
+      if (rng_type==R_DRAND48 || !skip) return number.draw() ;
+      if ((left-=number.mean)>=0) return 0 ;
+      restart() ;
+      return number.draw_positive() ;
+    }
+    inline unsigned int kind(float &q) { // DRIVER_PM, RESISTANT_PM or 0 for a passenger; q is uniform, for drivers only
+      if (rng_type==R_DRAND48) { // two draws as in older versions
+        if (p_driver>=0 && _drand48()<p_driver) { q=_drand48() ; return DRIVER_PM ; }
+        return _drand48()<p_res ? RESISTANT_PM : 0 ;
+      }
+      double u=_drand48() ;
+      if (u<t_driver) { q=u/t_driver ; return DRIVER_PM ; }
+      return u<t_res ? RESISTANT_PM : 0 ;
+    }
+};
+
+void release(Genotype *g) ; // drops a reference to g, deleting g and its ancestors which are no longer needed
+
+class Spectrum { // site-frequency spectrum of all mutations, kept up to date by add_cells()
+  public:
+    vector <int> sfs ; // sfs[k] = no. of mutations which k>0 cells have
+    int thr, det ; // det = no. of mutations which more than thr cells have
+    Spectrum() { clear() ; }
+    void clear() { sfs.assign(2,0) ; thr=det=0 ; }
+    inline void move(int k, int k2, int n) { // n mutations go from k to k2 cells
+      if (k2>=sfs.size()) sfs.resize(2*k2,0) ;
+      if (k>0) sfs[k]-=n ; 
+      if (k2>0) sfs[k2]+=n ; 
+      if (k>thr) det-=n ; 
+      if (k2>thr) det+=n ;
+    }
+    int detected(float min_no) { // no. of mutations which more than min_no cells have, O(1) if min_no changes slowly
+      int t=int(floor(min_no)) ;
+      while (thr<t) { thr++ ; if (thr<sfs.size()) det-=sfs[thr] ; }
+      while (thr>t) { if (thr<sfs.size()) det+=sfs[thr] ; thr-- ; }
+      return det ;
+    }
+};
+
+class SeqIterator { // goes through the full sequence of a genotype, from the oldest mutation to the newest
+  public:                   // for (SeqIterator it(g);!it.end();it++) ... *it ...
+    vector <Genotype*> path ; // ancestors with new mutations, the oldest one last
+    int d, j ;
+    SeqIterator(Genotype *g) { 
+      for (;g!=NULL;g=g->mother_genotype) if (g->no_snps>0) path.push_back(g) ; 
+      d=path.size()-1 ; j=0 ; 
+    }
+    inline int end() { return d<0 ; }
+    inline unsigned int operator*() { return path[d]->snps[j] ; }
+    inline void operator++(int) { if (++j==path[d]->no_snps) { j=0 ; d-- ; } }
+};
+
+class LcaIndex { // lowest common ancestors in the genotype tree, build() it before a batch of queries
+  public:       // the LCA of nodes at DFS positions u<v is the mother with the smallest position among nodes u+1..v
+    static const int B=16 ; // block length, table[] keeps minima over whole blocks
+    vector <Genotype*> node ; // genotypes in genotypes[] and all their ancestors, in DFS order from the root
+    vector <int> up ; // DFS position of the mother of node[i], -1 for the root
+    vector <int> freq ; // no. of mutations of node[i] and its ancestors which are frequent, see count_frequent()
+    vector < vector <int> > table ; // table[l][b] = min of up[] over blocks b..b+2^l-1
+    void build() ;
+    void count_frequent(float min_no) ; // a mutation is frequent if more than min_no cells have it
+    int lca(int u, int v) ; // DFS positions
+    inline Genotype *lca(Genotype *a, Genotype *b) { return node[lca(a->dfs,b->dfs)] ; } // the youngest genotype from which both a and b descend
+};
+
+struct CloneExtent { // where the cells of a clone are
+  vecd mean ; 
+  double rg ; // radius of gyration
+  IVec lo, hi ; // bounding box
+};
+
+class CloneIndex { // genotypes and cells which have a given PM, using the DFS order of lca_index
+  public:           // descendants of lca_index.node[i] are nodes i..end[i]-1, their cells are cell[first[i]..first[end[i]]-1]
+    vector <int> end, first, cell ;
+    vector < pair <unsigned int,int> > origin ; // the first PM of every node with new PMs and the node's position, by PM
+    void build() ; // after lca_index.build(), valid as long as cells do not change
+    int find(unsigned int pm) ; // position of the node in which pm arose, -1 if it is not in any cell
+    inline int no_cells(int i) { return first[end[i]]-first[i] ; }
+    int no_genotypes(int i) ; // genotypes with cells
+    CloneExtent extent(int i) ;
+};
+void cell_position(int i, IVec &r) ; // position of cell i as in the output files
+
+class RateTree {  // binary sum tree of per-cell event rates: O(log N) updates and sampling
+  public:
+    int size ; // number of leaves, always a power of 2 
+    double *t ; // t[1] is the total rate, leaf of cell n is t[size+n]
+    RateTree() { size=0 ; t=NULL ; }
+    ~RateTree() { delete [] t ; }
+    void clear(int n) {
+      delete [] t ; 
+      for (size=1;size<n;size*=2) ;
+      t=new double[2*size] ; if (t==NULL) err("out of memory when allocating RateTree") ;
+      for (int i=0;i<2*size;i++) t[i]=0 ;
+    }
+    void grow() { // double the number of leaves keeping their values
+      double *nt=new double[4*size] ; if (nt==NULL) err("out of memory when allocating RateTree") ;
+      int i ;
+      for (i=0;i<4*size;i++) nt[i]=0 ;
+      for (i=0;i<size;i++) nt[2*size+i]=t[size+i] ;
+      delete [] t ; t=nt ; size*=2 ;
+      for (i=size-1;i>0;i--) t[i]=t[2*i]+t[2*i+1] ;
+    }
+    inline void set(int n, double r) {
+      while (n>=size) grow() ;
+      n+=size ; t[n]=r ;
+      for (n>>=1;n>0;n>>=1) t[n]=t[2*n]+t[2*n+1] ;
+    }
+    inline double total() { return t[1] ; }
+    inline int find(double &q) { // returns the leaf in which q falls, q becomes the remainder within this leaf
+      int i=1 ;
+      while (i<size) {
+        i*=2 ; 
+        if (q>=t[i] && t[i+1]>0) { q-=t[i] ; i++ ; }
+      }
+      return i-size ;
+    }
 };
 
 class Hist {
@@ -290,5 +535,13 @@ class Hist {
 
 //#endif
 
-extern vector<Genotype*> genotypes ;
-extern vector<Lesion*> lesions ;
+extern vector<Genotype*> genotypes ; // indexed by genotype id, NULL for unused ids
+extern vector<int> free_genotype_ids ;
+extern GenotypeArena genotype_arena ;
+extern MutationSampler mutation_sampler ;
+extern LcaIndex lca_index ;
+extern Spectrum spectrum ;
+extern CloneIndex clone_index ;
+extern vector<Lesion*> lesions ; // indexed by lesion id, NULL for unused ids
+extern vector<int> lesion_list ; // ids of existing lesions
+extern LesionGrid lesion_grid ;
@@ -6,3 +6,17 @@ const unsigned int SOMECELLS = 8;
 const unsigned int F_POINTCLOUD = 16;
 const unsigned int MOSTABUND = 32;
 const unsigned int F_TABLES = 64;
+
+// simulation methods, birth and death rules (selected from the command line)
+const int M_NORMAL = 0; // standard simulation method described in the paper (non-KMC)
+const int M_FASTER_KMC = 1;
+const int M_GILLESPIE = 2;
+const int B_LINEAR = 0; // birth rate proportional to the no. of empty neighbours
+const int B_CONST = 1; // birth rate does not depend on the no. of empty neighbours as long as there is at least one
+const int B_PUSHING = 2; // cells push away other cells as they grow, requires PUSHING 
+const int D_VOLUME = 0; // cells die also in the volume
+const int D_SURFACE = 1; // cells die on surface only
+const int O_GAUSS_SEIDEL = 0; // overlap of lesions removed by sequential sweeps in random order
+const int O_JACOBI = 1; // all lesions moved at once in each sweep, can be run in parallel
+const int R_PHILOX = 0; // counter-based random number generator with a stream for each sample
+const int R_DRAND48 = 1; // the generator of older versions, reproduces their runs
@@ -30,23 +30,28 @@
 
 
 #include <math.h>
+#include <algorithm>
 #include "params.h"
 #include "classes.h"
 
-void save_snps(char *name,int *n, int total, int mode, int *most_abund) 
+void save_snps(char *name, int total, int mode, int *most_abund, unsigned int flag) // only PMs with the flag set unless flag==0, lca_index must be built
 {
   const float cutoff=0.01 ;
   FILE *f=fopen(name,"w") ;
   if (f==NULL) err(name) ;
-  int i, j, nsnps=0, nsnpsc=0;
-  for (i=0;i<L;i++) { 
-    if (n[i]>(1e-4)*total) nsnps++ ;
-    if (1.*n[i]/total>cutoff) nsnpsc++ ;
+  int i, j, nsnps, nsnpsc=0;
+  vector < pair <unsigned int,int> > pm ; // ids and numbers of cells of PMs present in enough cells
+  for (i=0;i<lca_index.node.size();i++) {
+    Genotype *g=lca_index.node[i] ;
+    if (g->clade>(1e-4)*total) 
+      for (j=0;j<g->no_snps;j++) if (flag==0 || (g->snps[j]&flag)) pm.push_back(make_pair(g->snps[j]&L_PM,g->clade)) ;
   }
+  sort(pm.begin(),pm.end()) ; // by increasing id
+  nsnps=pm.size() ;
+  for (i=0;i<nsnps;i++) if (1.*pm[i].second/total>cutoff) nsnpsc++ ;
   float *abund=new float[nsnps], tempd ;
   int *num=new int[nsnps], temp ;
-  nsnps=0 ;
-  for (i=0;i<L;i++) if (n[i]>(1e-4)*total) { num[nsnps]=i ; abund[nsnps]=float(1.*n[i]/total)*(1+0.000001*i/L) ; nsnps++ ; }
+  for (i=0;i<nsnps;i++) { num[i]=pm[i].first ; abund[i]=float(1.*pm[i].second/total)*(1+0.000001*pm[i].first/L) ; }
   quicksort2(abund,num,0,nsnps-1) ;
 
   if (mode) {
@@ -74,24 +79,9 @@ void save_snp_corr(char *name, Hist *snps)
 
 
 
-int how_many_SNPs_identical(Genotype *a, Genotype *b)
+int how_many_SNPs_identical(Genotype *a, Genotype *b) // SNPs are unique, so a and b share exactly those of their common ancestor
 {
-  int i,j,n=0;
-  int al=a->sequence.size(), bl=b->sequence.size() ;
-  for (i=0;i<al;i++)
-    for (j=0;j<bl;j++) 
-      if (a->sequence[i]==b->sequence[j]) n++ ;
-  return n ;
-}
-
-int how_many_SNPs_identical(Genotype *a, Genotype *b, float cutoff, int *snp_no)
-{
-  int i,j,n=0, ntot=cells.size();
-  int al=a->sequence.size(), bl=b->sequence.size() ;
-  for (i=0;i<al;i++)
-    for (j=0;j<bl;j++) 
-      if (a->sequence[i]==b->sequence[j] && snp_no[(a->sequence[i])&L_PM]>cutoff*ntot) n++ ;
-  return n ;
+  return lca_index.lca(a,b)->length ;
 }
 
 
@@ -134,15 +124,16 @@ void snps_corr(Hist *snps)
   }  
 }
 
-void snps_corr_cutoff(Hist *snps,float cutoff,int *snp_no) 
+void snps_corr_cutoff(Hist *snps,float cutoff) 
 {
   int i,j,k,n;
   int ntot=cells.size() ;
     
   for (i=0;i<_bins;i++) snps[i].x=snps[i].x2=snps[i].n=0 ;
+  lca_index.count_frequent(cutoff*ntot) ;
   for (k=0;k<ntot;k++) {
     select_two_random_cells(i,j,n) ;
-    snps[n]+=how_many_SNPs_identical(genotypes[cells[i].gen],genotypes[cells[j].gen],cutoff,snp_no) ;
+    snps[n]+=lca_index.freq[lca_index.lca(genotypes[cells[i].gen]->dfs,genotypes[cells[j].gen]->dfs)] ;
   }  
   
 }
@@ -151,18 +142,12 @@ void snps_corr_cutoff(Hist *snps,float cutoff,int *snp_no)
 void snps_corr_cond_driver(Hist *snps)
 {
   int ntot=cells.size() ;
-  int i,j,k,n,d,ai,aj;
+  int i,j,k,n;
     
   for (k=0;k<ntot;k++) {
     select_two_random_cells(i,j,n) ;
-    Genotype *gi=genotypes[cells[i].gen], *gj=genotypes[cells[j].gen]  ;    
-    d=0 ;
-    for (ai=0;ai<gi->sequence.size();ai++) if (gi->sequence[ai]<0) {
-      for (aj=0;aj<gj->sequence.size();aj++) if (gi->sequence[ai]==gj->sequence[aj]) { d++ ; break ; }
-    }
-    if (d>0) {
-      snps[n]+=how_many_SNPs_identical(genotypes[cells[i].gen],genotypes[cells[j].gen]) ;
-    }
+    Genotype *a=lca_index.lca(genotypes[cells[i].gen],genotypes[cells[j].gen]) ;
+    if (a->no_drivers>0) snps[n]+=a->length ; // the cells share a driver iff their common ancestor has one
   }  
 }
 
@@ -173,33 +158,15 @@ void find_p_driver(Hist *pr1, Hist *pr2, Hist *pr3)
 // 1) prob. that two cells at distance x have at least one common driver
 // 2) prob. that two cells at distance x have the same last driver
 // 3) prob. that two cells at distance x have the same first driver
-  int i,j,k,n,ai,aj,d,di,dj;
+// The drivers shared by two cells are those of their common ancestor a, which are the oldest drivers of either cell.
+  int i,j,k,n;
   int ntot=cells.size() ;
     
   for (k=0;k<ntot;k++) {
     select_two_random_cells(i,j,n) ;
-    Genotype *gi=genotypes[cells[i].gen], *gj=genotypes[cells[j].gen]  ;    
-    
-    d=0 ; 
-    for (ai=0;ai<gi->sequence.size();ai++) if (gi->sequence[ai]<0) {
-      di++ ;
-      for (aj=0;aj<gj->sequence.size();aj++) if (gi->sequence[ai]==gj->sequence[aj]) { d++ ; break ; }
-    }
-    pr1[n]+=(d>0?1:0) ;
-
-    d=0 ;
-    for (ai=gi->sequence.size()-1;ai>=0;ai--) if (gi->sequence[ai]<0) {
-      for (aj=0;aj<gj->sequence.size();aj++) if (gi->sequence[ai]==gj->sequence[aj]) { d++ ; break ; }
-      break ;
-    }
-    pr2[n]+=(d>0?1:0) ;
-
-    d=0 ;
-    for (ai=0;ai<gi->sequence.size();ai++) if (gi->sequence[ai]<0) {
-      for (aj=0;aj<gj->sequence.size();aj++) if (gi->sequence[ai]==gj->sequence[aj]) { d++ ; break ; }
-      break ;
-    }
-    pr3[n]+=(d>0?1:0) ;
-        
+    Genotype *gi=genotypes[cells[i].gen], *a=lca_index.lca(gi,genotypes[cells[j].gen]) ;
+    pr1[n]+=(a->no_drivers>0?1:0) ;
+    pr2[n]+=(a->no_drivers>0 && a->no_drivers==gi->no_drivers?1:0) ; // i has no drivers younger than a
+    pr3[n]+=(a->no_drivers>0?1:0) ;
   }  
 }
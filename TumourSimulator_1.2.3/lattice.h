@@ -0,0 +1,380 @@
+/*******************************************************************************
+   TumourSimulator v.1.2.3 - a program that simulates a growing solid tumour.
+   Based on the algorithm described in
+
+   Bartlomiej Waclaw, Ivana Bozic, Meredith E. Pittman, Ralph H. Hruban,
+   Bert Vogelstein, and Martin A. Nowak. "Spatial Model Predicts That
+   Dispersal and Cell Turnover Limit Intratumour Heterogeneity" Nature 525,
+   no. 7568 (September 10, 2015): 261-64. doi:10.1038/nature14971.
+
+   Contributing author:
+   Dr Bartek Waclaw, University of Edinburgh, bwaclaw@staffmail.ed.ac.uk
+
+   Copyright (2015) The University of Edinburgh.
+
+    This file is part of TumourSimulator.
+
+    TumourSimulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    TumourSimulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the file
+    License.txt or at <http://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// Occupancy lattice of a lesion. Sites are grouped into 4x4x4 bricks, each stored as a single 64-bit word,
+// and 8x8x8 bricks form a node (32^3 sites). A node keeps only its non-empty bricks, in a compact array in
+// Morton order, and a 512-bit mask of which bricks these are, so a brick is found by a popcount. Nodes are allocated
+// only when a site in them becomes occupied and freed when they become empty, and are found through a hash
+// table, so the memory used is proportional to the occupied part of the lesion and the lattice never needs
+// to be resized. A 3x3x3 neighbourhood touches at most 8 bricks, usually in the same node.
+// If index is set, each brick also keeps the indices of the cells at its occupied sites, and if nbmask is set
+// their numbers of occupied neighbours. Both are kept in one compact array per non-empty brick, ordered as the
+// bits of the brick and allocated in steps of 8 sites, so they cost about 4 and 1 bytes per occupied site.
+// Coordinates are relative to the origin o, which can be moved without touching the data.
+// A new lattice keeps up to SMALL sites of the 8x8x8 window [o-4,o+3]^3 inline, as 8 bricks with compact
+// arrays of counts and cell indices, and allocates nothing. It switches to the hashed nodes the first time
+// it outgrows the window, so most one-cell lesions never touch the heap.
+
+class Lattice {
+  public:
+    struct Node {
+      QWORD m[8] ; // bit br&63 of m[br>>6] is set if brick br is non-empty
+      short pre[8] ; // no. of non-empty bricks in m[0..i-1]
+      int nz, room ; // no. of non-empty bricks and room in b[] and d[]
+      QWORD *b ; // non-empty bricks ordered by brick index, bit (x&3)+4*(y&3)+16*(z&3) of a brick is site (x,y,z)
+      BYTE **d ; // per non-empty brick: cell indices (int) and then counts of occupied neighbours (BYTE) of its 
+                 // occupied sites, room for cap() sites each; NULL if neither is kept
+    } ;
+    int o ; // origin, site (o,o,o) is the centre of the lesion
+    int size, no ; // size of the hash table (a power of 2) and no. of nodes
+    QWORD *keys ; // keys of nodes, or EMPTY
+    Node **nodes ;
+    QWORD lastkey ; Node *last ; // most recently used node
+    static const QWORD EMPTY=~0ULL ;
+    static const int BIAS=(1<<20)+16 ; // added to coordinates to make them positive; odd multiple of 16, so the origin is in the middle of a node
+    static unsigned int nbmask ; // bits of box() which are counted as neighbours, 0 if counts are not kept
+    static int index ; // if set, the cell index of each occupied site is kept
+    static const int SMALL=16, SB=(BIAS-4)>>2 ; // SB is the first brick of the inline window [o-4,o+3] in each direction
+    QWORD sb[8] ; // inline bricks, used while size==0
+    int sn ; // no. of inline sites
+    BYTE sc[SMALL] ; int sci[SMALL] ; // counts and cell indices of the inline sites, ordered as the bits of sb[]
+
+    Lattice(int o0) {
+      o=o0 ; no=0 ; size=0 ; keys=NULL ; nodes=NULL ;
+      sn=0 ; for (int i=0;i<8;i++) sb[i]=0 ;
+    }
+    ~Lattice() {
+      for (int i=0;i<size;i++) if (keys[i]!=EMPTY) free_node(nodes[i]) ;
+      delete [] keys ; delete [] nodes ;
+    }
+
+    static inline QWORD key(unsigned int nx, unsigned int ny, unsigned int nz) { return nx | (QWORD(ny)<<21) | (QWORD(nz)<<42) ; }
+    inline unsigned int slot(QWORD k) { return (k*0x9E3779B97F4A7C15ULL)>>(64-__builtin_ctz(size)) ; }
+    static inline int brick(unsigned int bx, unsigned int by, unsigned int bz) { // Morton index of a brick in its node
+      static const int m[8]={0,1,8,9,64,65,72,73} ;
+      return m[bx&7] | (m[by&7]<<1) | (m[bz&7]<<2) ;
+    }
+    static inline int bit(unsigned int x, unsigned int y, unsigned int z) { return (x&3) | ((y&3)<<2) | ((z&3)<<4) ; }
+    static inline int rank(QWORD w, int b) { return __builtin_popcountll(w&((1ULL<<b)-1)) ; } // position of site b in the arrays of its brick
+    static inline int cap(int n) { return (n+7)&~7 ; } // room in the arrays of a brick with n sites
+    static inline int per_site() { return (index ? sizeof(int) : 0)+(nbmask ? 1 : 0) ; } // bytes kept per site
+    static inline int *cells_of(BYTE *d) { return (int*)d ; }
+    static inline BYTE *counts_of(BYTE *d, int n) { return d+(index ? cap(n)*sizeof(int) : 0) ; }
+    static inline int find_brick(Node *nd, int br) { // position of a brick in b[], -1 if it is empty
+      QWORD m=nd->m[br>>6], u=1ULL<<(br&63) ;
+      return (m&u) ? nd->pre[br>>6]+__builtin_popcountll(m&(u-1)) : -1 ;
+    }
+    int add_brick(Node *nd, int br) { // makes room for a new, empty brick and returns its position
+      int i=nd->pre[br>>6]+__builtin_popcountll(nd->m[br>>6]&((1ULL<<(br&63))-1)), j ;
+      if (nd->nz==nd->room) {
+        nd->room=nd->room ? 2*nd->room : 8 ;
+        nd->b=(QWORD*)realloc(nd->b,nd->room*sizeof(QWORD)) ; if (nd->b==NULL) err("out of memory when allocating Lattice") ;
+        if (per_site()) { nd->d=(BYTE**)realloc(nd->d,nd->room*sizeof(BYTE*)) ; if (nd->d==NULL) err("out of memory when allocating Lattice") ; }
+      }
+      memmove(nd->b+i+1,nd->b+i,(nd->nz-i)*sizeof(QWORD)) ; nd->b[i]=0 ;
+      if (per_site()) { memmove(nd->d+i+1,nd->d+i,(nd->nz-i)*sizeof(BYTE*)) ; nd->d[i]=NULL ; }
+      nd->m[br>>6]|=1ULL<<(br&63) ; for (j=(br>>6)+1;j<8;j++) nd->pre[j]++ ;
+      nd->nz++ ;
+      return i ;
+    }
+    void remove_brick(Node *nd, int br, int i) { // removes the empty brick br at position i, shrinks b[] and d[] when a quarter full
+      memmove(nd->b+i,nd->b+i+1,(nd->nz-i-1)*sizeof(QWORD)) ;
+      if (per_site()) memmove(nd->d+i,nd->d+i+1,(nd->nz-i-1)*sizeof(BYTE*)) ;
+      nd->m[br>>6]&=~(1ULL<<(br&63)) ; for (int j=(br>>6)+1;j<8;j++) nd->pre[j]-- ;
+      nd->nz-- ;
+      if (nd->room>8 && 4*nd->nz<=nd->room) {
+        nd->room/=2 ;
+        nd->b=(QWORD*)realloc(nd->b,nd->room*sizeof(QWORD)) ;
+        if (per_site()) nd->d=(BYTE**)realloc(nd->d,nd->room*sizeof(BYTE*)) ;
+      }
+    }
+
+    void rehash(int nsize) {
+      QWORD *ok=keys ; Node **on=nodes ; int osize=size, i ;
+      size=nsize ; keys=new QWORD[size] ; nodes=new Node*[size] ; if (keys==NULL || nodes==NULL) err("out of memory when allocating Lattice") ;
+      for (i=0;i<size;i++) keys[i]=EMPTY ;
+      for (i=0;i<osize;i++) if (ok[i]!=EMPTY) {
+        unsigned int s=slot(ok[i]) ;
+        while (keys[s]!=EMPTY) s=(s+1)&(size-1) ;
+        keys[s]=ok[i] ; nodes[s]=on[i] ;
+      }
+      delete [] ok ; delete [] on ;
+      lastkey=EMPTY ; last=NULL ;
+    }
+
+    inline Node *find(QWORD k) { // returns NULL if the node does not exist
+      if (k==lastkey) return last ;
+      for (unsigned int s=slot(k);keys[s]!=EMPTY;s=(s+1)&(size-1))
+        if (keys[s]==k) { lastkey=k ; last=nodes[s] ; return last ; }
+      return NULL ;
+    }
+
+    Node *create(QWORD k) {
+      if (2*(no+1)>size) rehash(2*size) ;
+      unsigned int s=slot(k) ;
+      while (keys[s]!=EMPTY) s=(s+1)&(size-1) ;
+      Node *nd=new Node ; if (nd==NULL) err("out of memory when allocating Lattice") ;
+      for (int i=0;i<8;i++) { nd->m[i]=0 ; nd->pre[i]=0 ; }
+      nd->b=NULL ; nd->d=NULL ; nd->room=0 ;
+      nd->nz=0 ; keys[s]=k ; nodes[s]=nd ; no++ ;
+      lastkey=k ; last=nd ;
+      return nd ;
+    }
+
+    void free_node(Node *nd) {
+      if (nd->d!=NULL) { for (int i=0;i<nd->nz;i++) free(nd->d[i]) ; free(nd->d) ; }
+      free(nd->b) ; delete nd ;
+    }
+
+    void remove(QWORD k) { // removes an empty node, closing the gap in the probe sequence
+      unsigned int s=slot(k), t ;
+      while (keys[s]!=k) s=(s+1)&(size-1) ;
+      free_node(nodes[s]) ; no-- ;
+      for (t=(s+1)&(size-1);keys[t]!=EMPTY;t=(t+1)&(size-1)) {
+        unsigned int h=slot(keys[t]) ;
+        if (((t-h)&(size-1))>=((t-s)&(size-1))) { keys[s]=keys[t] ; nodes[s]=nodes[t] ; s=t ; }
+      }
+      keys[s]=EMPTY ;
+      lastkey=EMPTY ; last=NULL ;
+      if (size>16 && 8*no<size) rehash(size/2) ;
+    }
+
+    static inline int sbrick(unsigned int bx, unsigned int by, unsigned int bz) { // inline brick, -1 if outside the window
+      bx-=SB ; by-=SB ; bz-=SB ;
+      return (bx|by|bz)>1 ? -1 : bx+2*by+4*bz ;
+    }
+    inline int srank(unsigned int ux, unsigned int uy, unsigned int uz) { // position of an inline site in sc[] and sci[]
+      int i=sbrick(ux>>2,uy>>2,uz>>2), r=__builtin_popcountll(sb[i]&((1ULL<<bit(ux,uy,uz))-1)) ;
+      for (int j=0;j<i;j++) r+=__builtin_popcountll(sb[j]) ;
+      return r ;
+    }
+    long long int bytes() { // heap memory used, the inline part is counted in sizeof(Lesion)
+      long long int b=size*(sizeof(QWORD)+sizeof(Node*)) ;
+      for (int i=0;i<size;i++) if (keys[i]!=EMPTY) {
+        Node *nd=nodes[i] ;
+        b+=sizeof(Node)+nd->room*sizeof(QWORD) ;
+        if (nd->d!=NULL) {
+          b+=nd->room*sizeof(BYTE*) ;
+          for (int j=0;j<nd->nz;j++) b+=cap(__builtin_popcountll(nd->b[j]))*per_site() ;
+        }
+      }
+      return b ;
+    }
+    void promote() { // moves the inline sites to nodes
+      int i,n,x[SMALL],y[SMALL],z[SMALL],c[SMALL] ;
+      for (i=0,n=0;i<8;i++) for (QWORD w=sb[i];w;w&=w-1) {
+        int b=__builtin_ctzll(w) ;
+        x[n]=4*(SB+(i&1))+(b&3)+o-BIAS ; y[n]=4*(SB+((i>>1)&1))+((b>>2)&3)+o-BIAS ; z[n]=4*(SB+(i>>2))+(b>>4)+o-BIAS ; 
+        c[n]=sci[n] ; n++ ;
+      }
+      rehash(16) ; sn=0 ; for (i=0;i<8;i++) sb[i]=0 ;
+      for (i=0;i<n;i++) { set(x[i],y[i],z[i]) ; if (index) cell(x[i],y[i],z[i])=c[i] ; }
+    }
+
+    inline QWORD get_brick(unsigned int bx, unsigned int by, unsigned int bz) { // brick coordinates include BIAS
+      if (size==0) { int i=sbrick(bx,by,bz) ; return i<0?0:sb[i] ; }
+      Node *nd=find(key(bx>>3,by>>3,bz>>3)) ; if (nd==NULL) return 0 ;
+      int i=find_brick(nd,brick(bx,by,bz)) ;
+      return i<0?0:nd->b[i] ;
+    }
+
+    inline int is_set(int x, int y, int z) {
+      unsigned int ux=x-o+BIAS, uy=y-o+BIAS, uz=z-o+BIAS ;
+      return (get_brick(ux>>2,uy>>2,uz>>2)>>bit(ux,uy,uz))&1 ;
+    }
+    inline BYTE *count(int x, int y, int z) { // no. of occupied neighbours, only for an occupied site
+      unsigned int ux=x-o+BIAS, uy=y-o+BIAS, uz=z-o+BIAS ;
+      if (size==0) return sc+srank(ux,uy,uz) ;
+      Node *nd=find(key(ux>>5,uy>>5,uz>>5)) ;
+      int i=find_brick(nd,brick(ux>>2,uy>>2,uz>>2)) ; QWORD w=nd->b[i] ;
+      return counts_of(nd->d[i],__builtin_popcountll(w))+rank(w,bit(ux,uy,uz)) ;
+    }
+    inline int &cell(int x, int y, int z) { // index of the cell at an occupied site, only if index is set
+      unsigned int ux=x-o+BIAS, uy=y-o+BIAS, uz=z-o+BIAS ;
+      if (size==0) return sci[srank(ux,uy,uz)] ;
+      Node *nd=find(key(ux>>5,uy>>5,uz>>5)) ;
+      int i=find_brick(nd,brick(ux>>2,uy>>2,uz>>2)) ;
+      return cells_of(nd->d[i])[rank(nd->b[i],bit(ux,uy,uz))] ;
+    }
+    void add_to_neighbours(int x, int y, int z, unsigned int m, int d) { // adds d to the counts of the sites given by m (bits of box())
+      static const int dx[27]={-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1},
+                       dy[27]={-1,-1,-1,0,0,0,1,1,1,-1,-1,-1,0,0,0,1,1,1,-1,-1,-1,0,0,0,1,1,1} ;
+      while (m) {
+        int n=__builtin_ctz(m) ; m&=m-1 ;
+        *count(x+dx[n],y+dy[n],z+n/9-1)+=d ;
+      }
+    }
+    void set(int x, int y, int z) {
+      unsigned int ux=x-o+BIAS, uy=y-o+BIAS, uz=z-o+BIAS ;
+      if (size==0) {
+        int i=sbrick(ux>>2,uy>>2,uz>>2), b=bit(ux,uy,uz) ;
+        if (i>=0 && ((sb[i]>>b)&1)) return ;
+        if (i<0 || sn==SMALL) promote() ;
+        else { // insert the site into the inline arrays
+          int r=srank(ux,uy,uz) ;
+          memmove(sc+r+1,sc+r,sn-r) ; memmove(sci+r+1,sci+r,(sn-r)*sizeof(int)) ;
+          sc[r]=0 ; sci[r]=-1 ; sb[i]|=1ULL<<b ; sn++ ;
+          if (nbmask) {
+            unsigned int m=box(x,y,z)&nbmask ;
+            *count(x,y,z)=__builtin_popcount(m) ;
+            add_to_neighbours(x,y,z,m,1) ;
+          }
+          return ;
+        }
+      }
+      QWORD k=key(ux>>5,uy>>5,uz>>5) ;
+      Node *nd=find(k) ; if (nd==NULL) nd=create(k) ;
+      int br=brick(ux>>2,uy>>2,uz>>2), b=bit(ux,uy,uz), i=find_brick(nd,br) ;
+      if (i<0) i=add_brick(nd,br) ;
+      QWORD &w=nd->b[i] ;
+      if ((w>>b)&1) return ;
+      if (per_site()) { // insert -1 and 0 at the rank of the new site, growing the arrays in steps of 8
+        int n=__builtin_popcountll(w), r=rank(w,b) ;
+        BYTE *&d=nd->d[i] ;
+        if ((n&7)==0) { 
+          d=(BYTE*)realloc(d,cap(n+1)*per_site()) ; if (d==NULL) err("out of memory when allocating Lattice") ; 
+          if (index && nbmask) memmove(counts_of(d,n+1),counts_of(d,n),n) ; // the counts follow the longer array of indices
+        }
+        if (index) { int *ci=cells_of(d) ; memmove(ci+r+1,ci+r,(n-r)*sizeof(int)) ; ci[r]=-1 ; }
+        if (nbmask) { BYTE *c=counts_of(d,n+1) ; memmove(c+r+1,c+r,n-r) ; c[r]=0 ; }
+      }
+      w|=1ULL<<b ;
+      if (nbmask) {
+        unsigned int m=box(x,y,z)&nbmask ;
+        *count(x,y,z)=__builtin_popcount(m) ;
+        add_to_neighbours(x,y,z,m,1) ;
+      }
+    }
+    void unset(int x, int y, int z) {
+      unsigned int ux=x-o+BIAS, uy=y-o+BIAS, uz=z-o+BIAS ;
+      if (size==0) {
+        int i=sbrick(ux>>2,uy>>2,uz>>2), b=bit(ux,uy,uz) ;
+        if (i<0 || ((sb[i]>>b)&1)==0) return ;
+        if (nbmask) add_to_neighbours(x,y,z,box(x,y,z)&nbmask,-1) ;
+        int r=srank(ux,uy,uz) ;
+        memmove(sc+r,sc+r+1,sn-r-1) ; memmove(sci+r,sci+r+1,(sn-r-1)*sizeof(int)) ;
+        sb[i]&=~(1ULL<<b) ; sn-- ;
+        return ;
+      }
+      QWORD k=key(ux>>5,uy>>5,uz>>5) ;
+      Node *nd=find(k) ; if (nd==NULL) return ;
+      int br=brick(ux>>2,uy>>2,uz>>2), b=bit(ux,uy,uz), i=find_brick(nd,br) ;
+      if (i<0 || ((nd->b[i]>>b)&1)==0) return ;
+      if (nbmask) add_to_neighbours(x,y,z,box(x,y,z)&nbmask,-1) ;
+      QWORD &w=nd->b[i] ;
+      if (per_site()) { // remove the entries of the site and shrink the arrays in steps of 8
+        int n=__builtin_popcountll(w)-1, r=rank(w,b) ;
+        BYTE *&d=nd->d[i] ;
+        if (index) { int *ci=cells_of(d) ; memmove(ci+r,ci+r+1,(n-r)*sizeof(int)) ; }
+        if (nbmask) { BYTE *c=counts_of(d,n+1) ; memmove(c+r,c+r+1,n-r) ; }
+        if (n==0) { free(d) ; d=NULL ; }
+        else if ((n&7)==0) {
+          if (index && nbmask) memmove(counts_of(d,n),counts_of(d,n+1),n) ;
+          d=(BYTE*)realloc(d,cap(n)*per_site()) ;
+        }
+      }
+      w&=~(1ULL<<b) ;
+      if (w==0) { remove_brick(nd,br,i) ; if (nd->nz==0) remove(k) ; }
+    }
+
+    // masks of the sites of a brick whose local x (y,z) coordinate is in [lo,hi]
+    static inline QWORD xmask(int lo, int hi) { return QWORD((2<<hi)-(1<<lo))*0x1111111111111111ULL ; }
+    static inline QWORD ymask(int lo, int hi) { return QWORD((0x10<<(4*hi))-(1<<(4*lo)))*0x0001000100010001ULL ; }
+    static inline QWORD zmask(int lo, int hi) { return (hi==3?0:(1ULL<<(16*hi+16)))-(1ULL<<(16*lo)) ; }
+
+    int count_box(int x, int y, int z) { // no. of occupied sites in the 3x3x3 box centred at (x,y,z), the centre excluded
+      unsigned int ux=x-o+BIAS, uy=y-o+BIAS, uz=z-o+BIAS ;
+      unsigned int bx[2],by[2],bz[2] ; int n=0, nx,ny,nz, ix,iy,iz ;
+      QWORD mx[2],my[2],mz[2] ;
+      bx[0]=(ux-1)>>2 ; bx[1]=(ux+1)>>2 ;
+      if (bx[0]==bx[1]) { nx=1 ; mx[0]=xmask((ux-1)&3,(ux+1)&3) ; } else { nx=2 ; mx[0]=xmask((ux-1)&3,3) ; mx[1]=xmask(0,(ux+1)&3) ; }
+      by[0]=(uy-1)>>2 ; by[1]=(uy+1)>>2 ;
+      if (by[0]==by[1]) { ny=1 ; my[0]=ymask((uy-1)&3,(uy+1)&3) ; } else { ny=2 ; my[0]=ymask((uy-1)&3,3) ; my[1]=ymask(0,(uy+1)&3) ; }
+      bz[0]=(uz-1)>>2 ; bz[1]=(uz+1)>>2 ;
+      if (bz[0]==bz[1]) { nz=1 ; mz[0]=zmask((uz-1)&3,(uz+1)&3) ; } else { nz=2 ; mz[0]=zmask((uz-1)&3,3) ; mz[1]=zmask(0,(uz+1)&3) ; }
+      for (iz=0;iz<nz;iz++) for (iy=0;iy<ny;iy++) for (ix=0;ix<nx;ix++)
+        n+=__builtin_popcountll(get_brick(bx[ix],by[iy],bz[iz]) & mx[ix] & my[iy] & mz[iz]) ;
+      return n-is_set(x,y,z) ;
+    }
+
+    unsigned int box(int x, int y, int z) { // occupancy of the 3x3x3 box centred at (x,y,z), site (x+dx,y+dy,z+dz) is bit 9*(dz+1)+3*(dy+1)+dx+1
+      unsigned int ux=x-o+BIAS-1, uy=y-o+BIAS-1, uz=z-o+BIAS-1, m=0 ; // corner of the box
+      int nx=((ux&3)>1)+1, ny=((uy&3)>1)+1, nz=((uz&3)>1)+1, ix,iy,iz, x0=ux&3 ;
+      QWORD w[2][2][2] ;
+      for (iz=0;iz<nz;iz++) for (iy=0;iy<ny;iy++) for (ix=0;ix<nx;ix++) w[iz][iy][ix]=get_brick((ux>>2)+ix,(uy>>2)+iy,(uz>>2)+iz) ;
+      for (int dz=0;dz<3;dz++) for (int dy=0;dy<3;dy++) {
+        unsigned int Y=uy+dy, Z=uz+dz ;
+        iz=(Z>>2)-(uz>>2) ; iy=(Y>>2)-(uy>>2) ;
+        int sh=4*(Y&3)+16*(Z&3) ;
+        QWORD row=w[iz][iy][0]>>(sh+x0) ;
+        if (x0>1) row=(row&((1<<(4-x0))-1)) | ((w[iz][iy][1]>>sh)<<(4-x0)) ; // the row continues in the next brick
+        m|=(row&7)<<(9*dz+3*dy) ;
+      }
+      return m ;
+    }
+
+    static inline int select_bit(unsigned int m, int r) { // position of the r-th (from 0) set bit of a mask of box()
+#ifdef __BMI2__
+      return __builtin_ctz(_pdep_u32(1u<<r,m)) ;
+#else
+      int c=__builtin_popcount(m&0x1ff) ; // skip whole planes dz=-1,0 first
+      if (r>=c) { r-=c ; m&=~0x1ffu ; c=__builtin_popcount(m&0x3fe00) ; if (r>=c) { r-=c ; m&=~0x3ffffu ; } }
+      for (;r>0;r--) m&=m-1 ;
+      return __builtin_ctz(m) ;
+#endif
+    }
+
+    int box_cells(int x, int y, int z, unsigned int m, int *c) { // indices of the cells at the occupied sites given by m (bits of box()), returns their number
+      static const int dx[27]={-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1,-1,0,1},
+                       dy[27]={-1,-1,-1,0,0,0,1,1,1,-1,-1,-1,0,0,0,1,1,1,-1,-1,-1,0,0,0,1,1,1} ;
+      int no=0 ;
+      QWORD lastb=EMPTY ; QWORD w=0 ; int *ci=NULL ;
+      while (m) {
+        int n=__builtin_ctz(m) ; m&=m-1 ;
+        unsigned int ux=x+dx[n]-o+BIAS, uy=y+dy[n]-o+BIAS, uz=z+n/9-1-o+BIAS ;
+        if (size==0) { c[no++]=sci[srank(ux,uy,uz)] ; continue ; }
+        QWORD kb=key(ux>>2,uy>>2,uz>>2) ;
+        if (kb!=lastb) { // sites in the same brick come one after another most of the time
+          Node *nd=find(key(ux>>5,uy>>5,uz>>5)) ;
+          int i=find_brick(nd,brick(ux>>2,uy>>2,uz>>2)) ;
+          w=nd->b[i] ; ci=cells_of(nd->d[i]) ; lastb=kb ;
+        }
+        c[no++]=ci[rank(w,bit(ux,uy,uz))] ;
+      }
+      return no ;
+    }
+
+};
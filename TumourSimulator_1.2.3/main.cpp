@@ -40,14 +40,6 @@ using namespace std;
 #include "classes.h"
 #include <tclap/CmdLine.h>
 
-#if (defined(GILLESPIE) && defined(FASTER_KMC)) || (defined(GILLESPIE) && defined(NORMAL)) || (defined(NORMAL) && defined(FASTER_KMC))
-  #error too many methods defined!
-#endif
-
-#if !defined(GILLESPIE) && !defined(FASTER_KMC) && !defined(NORMAL) 
-  #error no method defined!
-#endif
-
 #if (defined(VON_NEUMANN_NEIGHBOURHOOD) && defined(MOORE_NEIGHBOURHOOD))
   #error both VON_NEUMANN_NEIGHBOURHOOD and MOORE_NEIGHBOURHOOD defined!
 #endif
@@ -64,6 +56,14 @@ extern float time_to_treat ;
 int sample=0 ;
 float migr=10e-6 ;
 float gama=1e-2, gama_res=5e-8 ;
+int method=M_NORMAL, death_rule=D_VOLUME, core_is_dead=0 ;
+int overlap_solver=O_GAUSS_SEIDEL ;
+int rng_type=R_PHILOX ;
+#ifdef PUSHING
+int birth_rule=B_PUSHING ;
+#else
+int birth_rule=B_LINEAR ;
+#endif
 
 void save_positions(char *name, float dz) 
 {
@@ -107,13 +107,6 @@ void save_cell_table(char *name)
 {
   FILE *data = fopen(name, "w");
 
-  for (int i = 0; i < genotypes.size(); i++) {
-    
-    if (genotypes[i] != NULL && genotypes[i]->number > 0) {
-      genotypes[i]->identifier = i;
-    }
-  }
-
   fprintf(data, "cell_id,x,y,z,genotype_id\n");
   for (int i = 0; i < cells.size(); i++) {
     Lesion *ll = lesions[cells[i].lesion];
@@ -128,13 +121,6 @@ void save_genotype_table(char *name)
 {
   FILE *data = fopen(name, "w");
 
-  for (int i = 0; i < genotypes.size(); i++) {
-    
-    if (genotypes[i] != NULL && genotypes[i]->number > 0) {
-      genotypes[i]->identifier = i;
-    }
-  }
-
   fprintf(data, "genotype_id,mother_genotype_id\n");
   for (int i = 0; i < cells.size(); i++) {
     Genotype *g = genotypes[cells[i].gen];
@@ -155,21 +141,14 @@ void save_mutation_table(char *name)
 {
   FILE *data = fopen(name, "w");
 
-  for (int i = 0; i < genotypes.size(); i++) {
-    
-    if (genotypes[i] != NULL && genotypes[i]->number > 0) {
-      genotypes[i]->identifier = i;
-    }
-  }
-
   fprintf(data, "genotype_id,mutation_id,is_driver,is_resistant\n");
   for (int i = 0; i < cells.size(); i++) {
     Genotype *g = genotypes[cells[i].gen];
     
-    for (int j = 0; j < g->sequence.size(); j++) {
-      int mutation_id = (g->sequence[j] & ~DRIVER_PM & ~RESISTANT_PM);
-      bool is_driver = ((g->sequence[j] & DRIVER_PM) != 0);
-      bool is_resistant = ((g->sequence[j] & RESISTANT_PM) != 0); 
+    for (SeqIterator it(g); !it.end(); it++) {
+      int mutation_id = (*it & ~DRIVER_PM & ~RESISTANT_PM);
+      bool is_driver = ((*it & DRIVER_PM) != 0);
+      bool is_resistant = ((*it & RESISTANT_PM) != 0); 
       
       fprintf(data, "%d,%d,%d,%d\n", g->identifier, mutation_id, is_driver, is_resistant);
     }
@@ -361,8 +340,8 @@ void save_genotypes(char *name)
   for (int i=0;i<genotypes.size();i++) {
     Genotype *g=genotypes[i] ;
     if (g!=NULL && g->number>0) {
-      fprintf(data,"%d  %d  %d %d  %d\t",i, g->prev_gen,g->no_resistant,g->no_drivers, g->number) ;
-      for (int j=0;j<g->sequence.size();j++) fprintf(data," %u",g->sequence[j]) ; 
+      fprintf(data,"%d  %d  %d %d  %d\t",g->identifier, g->prev_gen,g->no_resistant,g->no_drivers, g->number) ;
+      for (SeqIterator it(g);!it.end();it++) fprintf(data," %u",*it) ; 
       fprintf(data,"\n") ;
     } 
   }
@@ -377,10 +356,10 @@ void save_most_abund_gens(char *name, int *most_abund)
     Genotype *gg=genotypes[i] ;
     if (gg!=NULL && gg->number>0) {
       int r=0,g=0,b=0 ;
-      for (int j=0;j<gg->sequence.size();j++) {
-        if ((gg->sequence[j]&L_PM)==most_abund[0]) r=1 ;
-        if ((gg->sequence[j]&L_PM)==most_abund[1]) g=1 ; 
-        if ((gg->sequence[j]&L_PM)==most_abund[2]) b=1 ;
+      for (SeqIterator it(gg);!it.end();it++) {
+        if ((*it&L_PM)==most_abund[0]) r=1 ;
+        if ((*it&L_PM)==most_abund[1]) g=1 ; 
+        if ((*it&L_PM)==most_abund[2]) b=1 ;
       }
       if (r || g || b) fprintf(data,"%d %d %d\t%d\n",r,g,b,gg->index) ;
     }
@@ -389,19 +368,39 @@ void save_most_abund_gens(char *name, int *most_abund)
 
 }
 
+void save_clone(char *name, unsigned int pm) // cells which have the PM, clone_index must be built
+{
+  FILE *data=fopen(name,"w") ;
+  fprintf(data,"cell_id,x,y,z\n") ;
+  int i=clone_index.find(pm) ;
+  if (i>=0) for (int j=clone_index.first[i];j<clone_index.first[clone_index.end[i]];j++) {
+    IVec r ; cell_position(clone_index.cell[j],r) ;
+    fprintf(data,"%d,%d,%d,%d\n",clone_index.cell[j],r.i,r.j,r.k) ;
+  }
+  fclose(data) ;
+}
+
+void save_clones(char *name) // size and extent of the clone of each driver, clone_index must be built
+{
+  FILE *data=fopen(name,"w") ;
+  for (int k=0;k<clone_index.origin.size();k++) {
+    int i=clone_index.origin[k].second ;
+    Genotype *g=lca_index.node[i] ;
+    for (int j=0;j<g->no_snps;j++) if (g->snps[j]&DRIVER_PM) {
+      CloneExtent e=clone_index.extent(i) ;
+      fprintf(data,"%d  %d %d  %f %f %f %f  %d %d %d %d %d %d\n",g->snps[j]&L_PM,clone_index.no_genotypes(i),clone_index.no_cells(i),
+        e.mean.x,e.mean.y,e.mean.z,e.rg,e.lo.i,e.hi.i,e.lo.j,e.hi.j,e.lo.k,e.hi.k) ;
+    }
+  }
+  fclose(data) ;
+}
+
 int main(int argc, char *argv[])
 {
-#if defined(GILLESPIE)   
-  cout <<"method: GILLESPIE\n" ;
-#endif
-#if defined(FASTER_KMC)   
-  cout <<"method: FASTER_KMC\n" ;
-#endif
-#if defined(NORMAL)   
-  cout <<"method: NORMAL\n" ;
-#endif
- 
-  int nsam ;
+  const char *method_names[]={"normal","kmc","gillespie"}, *birth_names[]={"linear","const","pushing"}, *death_names[]={"volume","surface"} ;
+  const char *overlap_names[]={"gauss-seidel","jacobi"}, *rng_names[]={"philox","drand48"} ;
+  int nsam, bench=0, rng_bench=0 ;
+  vector <int> clone_pms ; // PMs whose cells are saved
   try {
     
     TCLAP::CmdLine cmd("TumourSimulator");
@@ -411,6 +410,26 @@ int main(int argc, char *argv[])
     TCLAP::ValueArg<float> migrArg("m","migr","Migration probability",false,migr,"float",cmd);
     TCLAP::ValueArg<float> gamaArg("g","gama","Mutation probability per replication",false,gama,"float",cmd);
     TCLAP::ValueArg<float> gamaResArg("r","gama_res","Mutation probability for resistance mutations",false,gama_res,"float",cmd);
+    vector<string> allowed ; 
+    allowed.assign(method_names,method_names+3) ; TCLAP::ValuesConstraint<string> methodVals(allowed) ;
+    TCLAP::ValueArg<string> methodArg("M","method","Simulation method",false,method_names[method],&methodVals,cmd);
+#ifdef PUSHING
+    allowed.assign(birth_names+2,birth_names+3) ; 
+#else
+    allowed.assign(birth_names,birth_names+2) ; 
+#endif
+    TCLAP::ValuesConstraint<string> birthVals(allowed) ;
+    TCLAP::ValueArg<string> birthArg("b","birth","Birth rule: rate proportional to the no. of empty neighbours (linear) or constant if there is any (const)",false,birth_names[birth_rule],&birthVals,cmd);
+    allowed.assign(death_names,death_names+2) ; TCLAP::ValuesConstraint<string> deathVals(allowed) ;
+    TCLAP::ValueArg<string> deathArg("d","death","Death rule: cells die in the whole volume or on the surface only",false,death_names[death_rule],&deathVals,cmd);
+    TCLAP::SwitchArg coreArg("c","core_dead","Core cells are set to dead",cmd,false);
+    allowed.assign(overlap_names,overlap_names+2) ; TCLAP::ValuesConstraint<string> overlapVals(allowed) ;
+    TCLAP::ValueArg<string> overlapArg("o","overlap","Solver removing overlaps between lesions",false,overlap_names[overlap_solver],&overlapVals,cmd);
+    TCLAP::MultiArg<int> cloneArg("p","pm","Save the cells which have this PM, can be repeated",false,"int",cmd);
+    allowed.assign(rng_names,rng_names+2) ; TCLAP::ValuesConstraint<string> rngVals(allowed) ;
+    TCLAP::ValueArg<string> rngArg("","rng","Random number generator, drand48 reproduces runs of older versions",false,rng_names[rng_type],&rngVals,cmd);
+    TCLAP::SwitchArg benchArg("","bench_overlap","Compare the overlap solvers on random sets of lesions and exit",cmd,false);
+    TCLAP::SwitchArg benchRngArg("","bench_rng","Measure the speed of the random number generators and exit",cmd,false);
     cmd.parse(argc,argv);
     
     DIR = dirArg.getValue();
@@ -419,18 +438,32 @@ int main(int argc, char *argv[])
     migr = migrArg.getValue();
     gama = gamaArg.getValue();
     gama_res = gamaResArg.getValue();
+    for (int i=0;i<3;i++) if (methodArg.getValue()==method_names[i]) method=i ;
+    for (int i=0;i<3;i++) if (birthArg.getValue()==birth_names[i]) birth_rule=i ;
+    for (int i=0;i<2;i++) if (deathArg.getValue()==death_names[i]) death_rule=i ;
+    core_is_dead = coreArg.getValue();
+    for (int i=0;i<2;i++) if (overlapArg.getValue()==overlap_names[i]) overlap_solver=i ;
+    for (int i=0;i<2;i++) if (rngArg.getValue()==rng_names[i]) rng_type=i ;
+    bench = benchArg.getValue();
+    rng_bench = benchRngArg.getValue();
+    clone_pms = cloneArg.getValue();
   
   } catch (TCLAP::ArgException &e) {
     cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
   }
   
+  cout <<"method: "<<method_names[method]<<", birth: "<<birth_names[birth_rule]<<", death: "<<death_names[death_rule]<<(core_is_dead?", core is dead":"")<<", overlap: "<<overlap_names[overlap_solver]<<", rng: "<<rng_names[rng_type]<<endl ;
+  cout <<"cell store: "<<CellStore::bytes_per_cell()<<" bytes per cell"<<endl ;
   cout << DIR << " " << " " << nsam << " " << RAND << " " << migr << " " << gama << " " << gama_res << endl;
   _srand48(RAND) ;
   init();
+  if (bench) { bench_overlap() ; return 0 ; }
+  if (rng_bench) { bench_rng() ; return 0 ; }
   char name[256],name2[256] ;
   sprintf(name,"%s/each_run_%d.dat",DIR.c_str(),max_size) ;
   FILE *er=fopen(name,"w") ; fclose(er) ;
   for (sample=0;sample<nsam;sample++) { 
+    if (rng_type==R_PHILOX) rng.stream(sample,0) ; // drand48 has only one stream, which the samples continue
     reset() ;
 #ifdef MAKE_TREATMENT_N
     int s=0 ; while (main_proc(max_size,-1,-1, 10)==1) { s++ ; reset() ; } ; // initial growth until max size is reached, saved every 10 days
@@ -461,23 +494,13 @@ int main(int argc, char *argv[])
 
     // save some more data
     
-    int *snp_no=new int[L], *snp_drivers=new int[L] ; // array of SNPs abundances
-    for (int i=0;i<L;i++) { snp_no[i]=snp_drivers[i]=0 ; }
-    for (int i=0;i<genotypes.size();i++) {
-      if (genotypes[i]!=NULL && genotypes[i]->number>0) 
-        for (int j=0;j<genotypes[i]->sequence.size();j++) {
-          snp_no[((genotypes[i]->sequence[j])&L_PM)]+=genotypes[i]->number ;      
-          if (((genotypes[i]->sequence[j])&DRIVER_PM)) snp_drivers[((genotypes[i]->sequence[j])&L_PM)]+=genotypes[i]->number ;
-        }
-    }
-
-    save_spatial(snp_no) ;
+    lca_index.build() ;
+    save_spatial() ;
 
     printf("saving PMs...\n") ;
     int most_abund[100] ;
-    sprintf(name,"%s/all_PMs_%d_%d.dat",DIR.c_str(),RAND,sample) ; save_snps(name,snp_no,max_size,0,most_abund) ;
-    if (driver_adv>0 || driver_migr_adv>0) { printf("saving driver PMs...\n") ; sprintf(name,"%s/drv_PMs_%d_%d.dat",DIR.c_str(),RAND,sample) ; save_snps(name,snp_drivers,max_size,0,NULL) ; }
-    delete [] snp_no ; delete [] snp_drivers ;
+    sprintf(name,"%s/all_PMs_%d_%d.dat",DIR.c_str(),RAND,sample) ; save_snps(name,max_size,0,most_abund,0) ;
+    if (driver_adv>0 || driver_migr_adv>0) { printf("saving driver PMs...\n") ; sprintf(name,"%s/drv_PMs_%d_%d.dat",DIR.c_str(),RAND,sample) ; save_snps(name,max_size,0,NULL,DRIVER_PM) ; }
 
     if (nsam==1) {  // do this only when making images of tumours & running only one sample
       printf("saving images...\n") ;
@@ -501,6 +524,9 @@ int main(int argc, char *argv[])
       if (save_format&F_TABLES) { sprintf(name,"%s/cell_table_%d.pcd",DIR.c_str(),max_size) ; save_cell_table(name) ; }
       if (save_format&F_TABLES) { sprintf(name,"%s/genotype_table_%d.pcd",DIR.c_str(),max_size) ; save_genotype_table(name) ; }
       if (save_format&F_TABLES) { sprintf(name,"%s/mutation_table_%d.pcd",DIR.c_str(),max_size) ; save_mutation_table(name) ; }
+      clone_index.build() ;
+      if (save_format&F_TABLES) { sprintf(name,"%s/clones_%d.dat",DIR.c_str(),max_size) ; save_clones(name) ; }
+      for (int i=0;i<clone_pms.size();i++) { sprintf(name,"%s/clone_%d_%d.csv",DIR.c_str(),clone_pms[i],max_size) ; save_clone(name,clone_pms[i]) ; }
       if (save_format&F_IMAGE) { sprintf(name,"%s/genotypes_%d.dat",DIR.c_str(),max_size) ; save_genotypes(name) ; }
       if (save_format&MOSTABUND) { sprintf(name,"%s/most_abund_gens_%d.dat",DIR.c_str(),max_size) ; save_most_abund_gens(name,most_abund) ; }
     }
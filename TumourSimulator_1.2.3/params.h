@@ -30,17 +30,16 @@
 
 #include "const.h"
 
-//---- exactly one method should be defined------
-//#define GILLESPIE
-//#define FASTER_KMC
-#define NORMAL  // standard simulation method described in the paper (non-KMC)
-//-----------------------------------------------
+// the simulation method (normal, kmc or gillespie), the birth and death rules and core death 
+// are chosen from the command line, see main.cpp
+extern int method, birth_rule, death_rule, core_is_dead ;
+extern int overlap_solver ; // how the mechanics removes overlaps between lesions
+extern int rng_type ; // the random number generator, see rng.h
 
 #define MANY_LESIONS // if defined, the number of lesions can be >65000
+#define COMPACT_GENOTYPES // if defined, unused genotype ids are removed when saving data if they are more than half of all ids
 
-//#define PUSHING // if defined, cells can push away other cells as they grow
-
-//#define CONST_BIRTH_RATE // if defined, birth rate does not depend on the no. of empty neighbours as long as there is at least one
+//#define PUSHING // if defined, cells can push away other cells as they grow (birth rule is then always "pushing")
 
 // ----------exactly one of these should be defined as the replication neighbourhood -----------
 //#define VON_NEUMANN_NEIGHBOURHOOD // 6 neighbours
@@ -62,8 +61,6 @@ extern float migr ;
 //const float migr[2][2]={{0,0} // before treatment: WT/resistant
 //                        ,{0,1e-5}}; // after treatment: WT/resistant
 
-//#define DEATH_ON_SURFACE ; // if defined then cells die on surface only upon treatment, if not then cells die also in the volume
-//#define CORE_IS_DEAD  // when set, core cells are set to dead 
 #define SHOW_ONLY_DRIVERS
 #define COLOR
 #define COLORS // if defined, genotypes change colours when mutating. The colours can then be used to create an image of the tumour
@@ -0,0 +1,152 @@
+/*******************************************************************************
+   TumourSimulator v.1.2.3 - a program that simulates a growing solid tumour.
+   Based on the algorithm described in
+
+   Bartlomiej Waclaw, Ivana Bozic, Meredith E. Pittman, Ralph H. Hruban,
+   Bert Vogelstein, and Martin A. Nowak. "Spatial Model Predicts That
+   Dispersal and Cell Turnover Limit Intratumour Heterogeneity" Nature 525,
+   no. 7568 (September 10, 2015): 261-64. doi:10.1038/nature14971.
+
+   Contributing author:
+   Dr Bartek Waclaw, University of Edinburgh, bwaclaw@staffmail.ed.ac.uk
+
+   Copyright (2015) The University of Edinburgh.
+
+    This file is part of TumourSimulator.
+
+    TumourSimulator is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    TumourSimulator is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    A copy of the GNU General Public License can be found in the file
+    License.txt or at <http://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+#include <string.h>
+
+// Uniform random numbers in [0,1). By default they come from Philox4x32-10 (J. K. Salmon et al., "Parallel 
+// random numbers: as easy as 1, 2, 3", SC11), a counter-based generator: block c of the stream with key k is 
+// a fixed function of (k,c). Streams keyed by seed, sample and thread are therefore independent, need no state 
+// other than the counter and can be filled in bulk. With --rng drand48 the 48-bit LCG of older versions is used 
+// instead. It has a single stream which all samples continue, so that old runs are reproduced bit for bit.
+// Numbers are made BUF at a time into a buffer, so that a draw is only a load. Philox blocks are computed
+// LANES at once with consecutive counters, and drand48 is run as LANES interleaved sequences using its jump-ahead
+// x_{n+k} = ja[k]*x_n + jc[k], so both loops vectorise; either way the numbers are the same as one by one.
+
+class Rng {
+  public:
+    static const int BUF=4096, LANES=16 ;
+    unsigned long long int x ; // drand48 state, after the last number in the buffer
+    unsigned long long int ja[LANES+1], jc[LANES+1] ; // drand48 jump-ahead by k steps
+    unsigned int key[2], ctr[4] ; // Philox key (seed, thread) and counter (block no., sample)
+    double buf[BUF] ; int pos, len ; // buf[pos..len-1] are the next numbers, each refill makes len of them
+    Rng() { 
+      ja[0]=1 ; jc[0]=0 ;
+      for (int k=0;k<LANES;k++) { ja[k+1]=(0x5deece66dULL*ja[k])&0xffffffffffffULL ; jc[k+1]=(0x5deece66dULL*jc[k]+0xb)&0xffffffffffffULL ; }
+      len=BUF ; seed(0) ; 
+    }
+    void seed(int s) { x=s ; key[0]=s ; stream(0,0) ; }
+    void stream(unsigned int sample, unsigned int thread) { key[1]=thread ; ctr[0]=ctr[1]=0 ; ctr[2]=sample ; ctr[3]=0 ; pos=len ; }
+    void buffer(int n) { len=n ; pos=len ; } // size of the buffer, 2<=n<=BUF and even; numbers in the buffer are lost
+    inline void block(unsigned int *o) { // next Philox block of 4 words
+      unsigned int c0=ctr[0], c1=ctr[1], c2=ctr[2], c3=ctr[3], k0=key[0], k1=key[1] ;
+      for (int r=0;r<10;r++) {
+        unsigned long long int p0=0xD2511F53ULL*c0, p1=0xCD9E8D57ULL*c2 ;
+        c0=(unsigned int)(p1>>32)^c1^k0 ; c1=(unsigned int)p1 ;
+        c2=(unsigned int)(p0>>32)^c3^k1 ; c3=(unsigned int)p0 ;
+        k0+=0x9E3779B9 ; k1+=0xBB67AE85 ;
+      }
+      o[0]=c0 ; o[1]=c1 ; o[2]=c2 ; o[3]=c3 ;
+      if (++ctr[0]==0) ctr[1]++ ;
+    }
+    static inline double to_double(unsigned int a, unsigned int b) { return ((a>>5)*67108864.0+(b>>6))*(1.0/9007199254740992.0) ; } // 53 bits
+    static void rounds(unsigned int *c0, unsigned int *c1, unsigned int *c2, unsigned int *c3, unsigned int k0, unsigned int k1) { // LANES blocks side by side
+      for (int r=0;r<10;r++) {
+        for (int l=0;l<LANES;l++) {
+          unsigned long long int p0=0xD2511F53ULL*c0[l], p1=0xCD9E8D57ULL*c2[l] ;
+          unsigned int a=(unsigned int)(p1>>32)^c1[l]^k0, b=(unsigned int)p1, c=(unsigned int)(p0>>32)^c3[l]^k1, d=(unsigned int)p0 ;
+          c0[l]=a ; c1[l]=b ; c2[l]=c ; c3[l]=d ;
+        }
+        k0+=0x9E3779B9 ; k1+=0xBB67AE85 ;
+      }
+    }
+    void generate(double *u, int n) { // the next n numbers, n even; short runs are made one by one
+      int i,l ;
+      if (rng_type==R_DRAND48) {
+        unsigned long long int y[LANES] ;
+        for (i=0;n-i<LANES && i<n;i++) { x=(0x5deece66dULL*x+0xb)&0xffffffffffffULL ; u[i]=x/281474976710656.0 ; }
+        for (;i<n;i+=LANES) {
+          int m=MIN(LANES,n-i) ;
+          for (l=0;l<LANES;l++) y[l]=(ja[l+1]*x+jc[l+1])&0xffffffffffffULL ;
+          for (l=0;l<m;l++) u[i+l]=y[l]/281474976710656.0 ;
+          x=y[m-1] ;
+        }
+      } else {
+        unsigned int c0[LANES], c1[LANES], c2[LANES], c3[LANES], o[4] ;
+        for (i=0;n-i<2*LANES && i<n;i+=2) { block(o) ; u[i]=to_double(o[2],o[3]) ; u[i+1]=to_double(o[0],o[1]) ; }
+        unsigned long long int c=ctr[0]|((unsigned long long int)ctr[1]<<32) ;
+        for (;i<n;i+=2*LANES) {
+          int m=MIN(LANES,(n-i)/2) ;
+          for (l=0;l<LANES;l++) { c0[l]=(unsigned int)(c+l) ; c1[l]=(unsigned int)((c+l)>>32) ; c2[l]=ctr[2] ; c3[l]=ctr[3] ; }
+          rounds(c0,c1,c2,c3,key[0],key[1]) ;
+          for (l=0;l<m;l++) { u[i+2*l]=to_double(c2[l],c3[l]) ; u[i+2*l+1]=to_double(c0[l],c1[l]) ; }
+          c+=m ;
+        }
+        ctr[0]=(unsigned int)c ; ctr[1]=(unsigned int)(c>>32) ;
+      }
+    }
+    void refill() { generate(buf,len) ; pos=0 ; }
+    inline double uniform() { 
+      if (pos==len) refill() ; 
+      return buf[pos++] ; 
+    }
+    void fill(double *u, int n) { // the same numbers as n calls of uniform()
+      int k=MIN(n,len-pos) ;
+      memcpy(u,buf+pos,k*sizeof(double)) ; pos+=k ;
+      if (k<n) { int m=(n-k)&~1 ; generate(u+k,m) ; k+=m ; } // straight into u, without the buffer
+      if (k<n) u[k]=uniform() ;
+    }
+};
+
+extern Rng rng ;
+inline double _drand48(void) { return rng.uniform() ; }
+inline void _srand48(int a) { rng.seed(a) ; }
+
+// Poisson numbers with a fixed mean, set up once by init(). For means below 10 the CDF is tabulated and a draw 
+// takes one uniform: a guide table (H.-C. Chen and Y. Asau, J. Chin. Inst. Eng. 3, 1974) gives the first k worth 
+// checking, from which the search is a step or two. Larger means use the transformed rejection PTRS (W. Hormann, 
+// Insur. Math. Econ. 12, 39 (1993)). With --rng drand48 the product of uniforms of older versions is kept.
+class Poisson {
+  public:
+    static const int K=64, G=32 ; // entries of the table and of the guide table
+    double mean, l ; // l=exp(-mean)
+    int table ; // cdf[] is used
+    double cdf[K] ; int guide[G] ; // cdf[k]=P(0)+..+P(k), 2 once the rest is negligible; guide[j]=first k with cdf[k]>j/G
+    double a, b, inv_alpha, vr, lmu ; // PTRS constants
+    Poisson() { init(0) ; }
+    void init(double mu) ;
+    int ptrs() ;
+    inline int draw() {
+      if (rng_type==R_DRAND48) { double p=1. ; int k=-1 ; do { k++ ; p*=_drand48() ; } while (p>l) ; return k ; }
+      if (!table) return ptrs() ;
+      double u=_drand48() ;
+      if (u<cdf[0]) return 0 ;
+      int k=guide[int(u*G)] ;
+      while (u>=cdf[k]) k++ ;
+      return k ;
+    }
+    inline int draw_positive() { // the same conditioned on k>0
+      if (!table) { int k ; do k=ptrs() ; while (k==0) ; return k ; }
+      double u=cdf[0]+(1-cdf[0])*_drand48() ;
+      int k=guide[int(u*G)] ;
+      while (u>=cdf[k]) k++ ;
+      return k ;
+    }
+};
@@ -50,11 +50,17 @@
 #include <string.h>
 #include <math.h>
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define SQR(x) (x)*(x)
 #define SWAPD(x, y) tempd = (x); (x) = (y); (y) = tempd
 #define SWAP(x, y) temp = (x); (x) = (y); (y) = temp
 #include <vector>
+#include <algorithm>
 #include <iostream>
+#include <chrono>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 using namespace std;
 
 string DIR ; // name given as 1st argument from the command line
@@ -140,20 +146,15 @@ void err(char *reason, double a)
   exit(0) ;
 }
 
-static long long unsigned int _x=0x000100010001LL, _mul=0x0005deece66dLL, _add=0xbLL ;
-double _drand48(void)  // works only on compilers with long long int!
-{
-  _x=_mul*_x+_add ; _x&=0xffffffffffffLL ;
-  return (_x/281474976710656.0) ;
-}
-
-void _srand48(int a) { _x=a ; }
+Rng rng ;
 
 void init();
 void end() ;
 
 double tt=0, tt_at_start ;
 int start_clock ;
+long long int events=0 ; // no. of iterations of the main loop since reset()
+int events_clock ;
 
 int L=0 ; // total number of SNPs
 int volume ; // total volume of the tumor
@@ -165,25 +166,54 @@ extern int sample ;
 int RAND ; // random seed
 char *timesbuffer ;
 
-int poisson(void)  // generates k from P(k)=exp(-gamma) gamma^k / k!
+void Poisson::init(double mu)
 {
-  const double l=exp(-gama) ;
-  double p=1. ;
-  int k=0 ;
-  do {
-    k++ ;
-    p*=_drand48() ;
-  } while (p > l) ;
-  return k - 1 ;
+  mean=mu ; l=exp(-mu) ; table=(mu<10) ;
+  if (table) {
+    double p=l, c=0 ;
+    for (int k=0;k<K;k++) {
+      c+=p ; p*=mu/(k+1) ; 
+      cdf[k]=(k<K-1 && (p>1e-17 || k<mu)) ? c : 2 ; // u<1 always stops at the first 2
+    }
+    for (int j=0,k=0;j<G;j++) { while (cdf[k]<=1.*j/G) k++ ; guide[j]=k ; }
+  } else {
+    b=0.931+2.53*sqrt(mu) ; a=-0.059+0.02483*b ; inv_alpha=1.1239+1.1328/(b-3.4) ; vr=0.9277-3.6224/(b-2) ; lmu=log(mu) ;
+  }
 }
 
+int Poisson::ptrs() 
+{
+  while (1) {
+    double u=_drand48()-0.5, v=_drand48(), us=0.5-fabs(u) ;
+    if (us==0) continue ;
+    int k=int(floor((2*a/us+b)*u+mean+0.43)) ;
+    if (us>=0.07 && v<=vr) return k ;
+    if (k<0 || (us<0.013 && v>us)) continue ;
+    if (log(v*inv_alpha/(a/(us*us)+b))<=-mean+k*lmu-lgamma(k+1.)) return k ;
+  }
+}
 
-vector<Cell> cells ;
+MutationSampler mutation_sampler ;
+
+void MutationSampler::init()
+{
+  set_mean(gama) ;
+  p_driver=(driver_adv>0 || driver_migr_adv>0) ? driver_prob/gama : -1 ; // in float, as it used to be compared
+  p_res=gama_res/gama ;
+  t_driver=MAX(p_driver,0) ; t_res=t_driver+(1-t_driver)*p_res ;
+}
+
+
+CellStore cells ;
 
 
 
 int Lesion::nl=0 ;
 double Lesion::maxdisp=0 ;
+#ifndef PUSHING
+int Lattice::index=0 ;
+unsigned int Lattice::nbmask=0 ;
+#endif
 double max_growth_rate ;
 
 #ifdef COLORS
@@ -201,11 +231,21 @@ Genotype::Genotype(void)
 #else
   m[0]=m[1]=migr ; 
 #endif
-  number=1 ; no_resistant=no_drivers=0 ; sequence.clear() ; prev_gen=-1 ;
+  number=clade=1 ; no_resistant=no_drivers=0 ; snps=NULL ; no_snps=0 ; prev_gen=-1 ;
   mother_genotype=NULL;
+  refs=1 ; length=depth=0 ; identifier=genotype_arena.serial++ ; dfs=-1 ;
 }
 
-Genotype::Genotype(Genotype *mother, int prevg, int no_snp) { 
+inline void add_cells(Genotype *g, int d) // changes the number of cells of g by d, and of cells with each mutation of g
+{
+  g->number+=d ;
+  for (;g!=NULL;g=g->mother_genotype) { 
+    if (g->no_snps>0) spectrum.move(g->clade,g->clade+d,g->no_snps) ; 
+    g->clade+=d ; 
+  }
+}
+
+Genotype::Genotype(Genotype *mother, int no_snp) { 
 #ifdef COLORS
   float rf=_drand48(), gf=_drand48(), bf=_drand48() ;
   static float q=0.8;
@@ -218,11 +258,13 @@ Genotype::Genotype(Genotype *mother, int prevg, int no_snp) {
 #endif
   death[0]=mother->death[0] ; growth[0]=mother->growth[0] ; m[0]=mother->m[0] ;
   death[1]=mother->death[1] ; growth[1]=mother->growth[1] ; m[1]=mother->m[1] ;
-  prev_gen=prevg ;
-  sequence=mother->sequence ; no_resistant=mother->no_resistant ; no_drivers=mother->no_drivers; 
+  prev_gen=mother->identifier ;
+  no_resistant=mother->no_resistant ; no_drivers=mother->no_drivers; 
+  snps=genotype_arena.alloc_snps(no_snp) ; no_snps=0 ;
   for (int i=0;i<no_snp;i++) {
-    if ((driver_adv>0 || driver_migr_adv>0) && _drand48()<driver_prob/gama) { 
-      float q=_drand48() ;
+    float q ;
+    unsigned int kind=mutation_sampler.kind(q) ;
+    if (kind==DRIVER_PM) { 
       if (driver_mode<2 || q<0.5) {
         death[0]*=1-driver_adv*driver_balance ; 
         growth[0]*=1+driver_adv*(1-driver_balance) ; if (max_growth_rate<growth[0]) max_growth_rate=growth[0] ;
@@ -233,148 +275,495 @@ Genotype::Genotype(Genotype *mother, int prevg, int no_snp) {
       }
       // drivers decrease prob. of death or increase prob. of growth
       drivers.push_back(L) ; //fprintf(drivers_file,"%d ",L) ; fflush(drivers_file) ; 
-      sequence.push_back((L++)|DRIVER_PM) ; no_drivers++ ;
-    } else {
-      if (_drand48()<gama_res/gama) {  
-        sequence.push_back((L++)|RESISTANT_PM) ; no_resistant++ ; // resistant mutation
-        death[1]=death0 ; growth[1]=growth0 ; 
+      snps[no_snps++]=(L++)|DRIVER_PM ; no_drivers++ ;
+    } else if (kind==RESISTANT_PM) {  
+      snps[no_snps++]=(L++)|RESISTANT_PM ; no_resistant++ ; // resistant mutation
+      death[1]=death0 ; growth[1]=growth0 ; 
 #ifdef MIGRATION_MATRIX
-        m[0]=migr[0][1] ; m[1]=migr[1][1] ;
+      m[0]=migr[0][1] ; m[1]=migr[1][1] ;
 #endif
-      } 
-      else sequence.push_back(L++) ;
-    }
+    } 
+    else snps[no_snps++]=L++ ;
   }
   if (L>1e9) err("L too big") ;
-  number=1 ;
-  mother_genotype=mother;
+  mother_genotype=mother; mother->refs++ ;
+  refs=1 ; length=mother->length+no_snps ; depth=mother->depth+1 ; identifier=genotype_arena.serial++ ; dfs=-1 ;
+  number=clade=0 ; add_cells(this,1) ;
 }
 
-vector<Genotype*> genotypes ;
-vector<Lesion*> lesions ;
+Genotype::~Genotype(void) 
+{ 
+  if (snps!=NULL) genotype_arena.free_snps(snps,no_snps) ; 
+}
 
-void Lesion::update_wx()
+void *Genotype::operator new(size_t s) { return genotype_arena.alloc_node() ; }
+void Genotype::operator delete(void *p) { genotype_arena.free_node(p) ; }
+
+void *GenotypeArena::alloc_node() 
 {
-  int i,j,k;
-  int nwx=int(wx*1.25) ;
-  if (nwx%2==1) nwx++ ; // make sure it's even
-  int dwx=(nwx-wx)/2 ;
+  nodes++ ;
+  if (node_list!=NULL) { void *p=node_list ; node_list=*(void**)p ; return p ; }
+  if (used==slabs.size()*SLAB) {
+    char *s=new char[SLAB*sizeof(Genotype)] ; if (s==NULL) err("out of memory when allocating genotypes") ;
+    slabs.push_back(s) ;
+  }
+  int i=used++ ;
+  return slabs[i/SLAB]+(i%SLAB)*sizeof(Genotype) ;
+}
 
-#ifdef PUSHING
-  for (i=0;i<wx;i++) {
-    for (j=0;j<wx;j++) {
-      Sites *np=new Sites[nwx] ;
-      for (k=0;k<nwx;k++) np[k]=-1 ;
-      for (k=dwx;k<wx+dwx;k++) np[k]=p[i][j][k-dwx] ;
-      delete p[i][j] ;
-      p[i][j]=np ;
+unsigned int *GenotypeArena::alloc_snps(int n) 
+{
+  if (n<2) n=2 ; // a freed list must be able to hold a pointer
+  if (n<=MAX_FREE && snp_lists[n]!=NULL) { unsigned int *s=snp_lists[n] ; memcpy(&snp_lists[n],s,sizeof(s)) ; return s ; }
+  if (n>SNP_SLAB) err("too many new mutations",n) ;
+  if (snp_pos+n>SNP_SLAB) { // the rest of the current slab is left unused
+    snp_slab++ ; snp_pos=0 ; 
+    if (snp_slab==snp_slabs.size()) {
+      unsigned int *s=new unsigned int[SNP_SLAB] ; if (s==NULL) err("out of memory when allocating genotypes") ;
+      snp_slabs.push_back(s) ;
     }
   }
+  unsigned int *s=snp_slabs[snp_slab]+snp_pos ; snp_pos+=n ;
+  return s ;
+}
 
-  Sites ***np=new Sites**[nwx] ;
-  for (i=0;i<nwx;i++) np[i]=new Sites*[nwx] ;
-    
-  for (i=0;i<nwx;i++) {
-    for (j=0;j<nwx;j++) {
-      if (i<dwx || i>=wx+dwx || j<dwx || j>=wx+dwx) {
-        np[i][j]=new Sites[nwx] ;
-        for (k=0;k<nwx;k++) np[i][j][k]=-1 ;
-      } else {
-        np[i][j]=p[i-dwx][j-dwx] ; 
-      }
+void GenotypeArena::free_snps(unsigned int *s, int n) 
+{
+  if (n<2) n=2 ;
+  if (n<=MAX_FREE) { memcpy(s,&snp_lists[n],sizeof(s)) ; snp_lists[n]=s ; }
+}
+
+void Genotype::get_sequence(vector <unsigned int> &s)
+{
+  s.clear() ;
+  for (SeqIterator it(this);!it.end();it++) s.push_back(*it) ;
+}
+
+void release(Genotype *g)
+{
+  while (g!=NULL && --g->refs==0) { 
+    Genotype *m=g->mother_genotype ; 
+    delete g ; g=m ; 
+  }
+}
+
+void LcaIndex::build()
+{
+  static vector <Genotype*> all ; // the same nodes in any order, all[i]->dfs==i until the end
+  static vector <int> start, child, pos, stack ; 
+  int i,j,k,l,n,b ;
+  all.clear() ; 
+  for (i=0;i<genotypes.size();i++) 
+    for (Genotype *g=genotypes[i];g!=NULL && !((unsigned int)g->dfs<all.size() && all[g->dfs]==g);g=g->mother_genotype) { 
+      g->dfs=all.size() ; all.push_back(g) ; 
     }
+  n=all.size() ; 
+  start.assign(n+1,0) ; child.resize(n) ; pos.resize(n) ; node.resize(n) ; up.resize(n) ;
+  for (i=0;i<n;i++) if (all[i]->mother_genotype!=NULL) start[all[i]->mother_genotype->dfs+1]++ ;
+  for (i=0;i<n;i++) start[i+1]+=start[i] ; // children of i will be child[start[i]..start[i+1]-1]
+  for (i=0;i<n;i++) pos[i]=start[i] ;
+  for (i=0;i<n;i++) if (all[i]->mother_genotype!=NULL) child[pos[all[i]->mother_genotype->dfs]++]=i ;
+
+  stack.clear() ; k=0 ;
+  for (i=0;i<n;i++) if (all[i]->mother_genotype==NULL) stack.push_back(i) ;
+  while (stack.size()>0) { // preorder, so that every subtree is a contiguous range of positions
+    i=stack.back() ; stack.pop_back() ; 
+    pos[i]=k ; node[k]=all[i] ; up[k]=(all[i]->mother_genotype==NULL ? -1 : pos[all[i]->mother_genotype->dfs]) ; k++ ;
+    for (j=start[i];j<start[i+1];j++) stack.push_back(child[j]) ;
+  }
+  for (i=0;i<n;i++) node[i]->dfs=i ;
+
+  int nb=(n+B-1)/B, levels=1 ;
+  while ((2<<(levels-1))<=nb) levels++ ;
+  table.resize(levels) ; 
+  table[0].resize(nb) ;
+  for (b=0;b<nb;b++) {
+    int m=up[b*B] ;
+    for (i=b*B+1;i<MIN(n,(b+1)*B);i++) if (up[i]<m) m=up[i] ;
+    table[0][b]=m ;
+  }
+  for (l=1;l<levels;l++) {
+    table[l].resize(nb-(1<<l)+1) ;
+    for (b=0;b<table[l].size();b++) table[l][b]=MIN(table[l-1][b],table[l-1][b+(1<<(l-1))]) ;
   }
+}
 
-  for (i=0;i<wx;i++) delete [] p[i] ; 
+int LcaIndex::lca(int u, int v)
+{
+  if (u==v) return u ;
+  if (u>v) { int t=u ; u=v ; v=t ; }
+  int i, l=u+1, m=up[l], bl=l/B, br=v/B ;
+  if (br-bl<2) { 
+    for (i=l+1;i<=v;i++) if (up[i]<m) m=up[i] ; 
+    return m ;
+  }
+  for (i=l+1;i<(bl+1)*B;i++) if (up[i]<m) m=up[i] ;
+  for (i=br*B;i<=v;i++) if (up[i]<m) m=up[i] ;
+  int k=0 ; 
+  while ((2<<k)<=br-bl-1) k++ ; // whole blocks bl+1..br-1 are covered by two overlapping ranges of 2^k blocks
+  return MIN(m,MIN(table[k][bl+1],table[k][br-(1<<k)])) ;
+}
 
-#else
-  for (i=0;i<wx*wx;i++) {
-    Sites *np=new Sites(nwx) ;
-    for (k=dwx;k<wx+dwx;k++) if (p[i]->is_set(k-dwx)) np->set(k) ;
-    delete p[i] ;
-    p[i]=np ;
+void LcaIndex::count_frequent(float min_no)
+{
+  freq.resize(node.size()) ;
+  for (int i=0;i<node.size();i++) {
+    Genotype *g=node[i] ;
+    int f=(up[i]<0 ? 0 : freq[up[i]]) ;
+    if (g->clade>min_no) f+=g->no_snps ;
+    freq[i]=f ;
   }
+}
 
-  if (float(nwx)*float(nwx)>2e9) err("nwx too large",nwx) ;
-  Sites **np=new Sites*[nwx*nwx] ;
-    
-  for (i=0;i<nwx;i++) {
-    for (j=0;j<nwx;j++) {
-      if (i<dwx || i>=wx+dwx || j<dwx || j>=wx+dwx) {
-        np[i*nwx+j]=new Sites(nwx) ;
-      } else {
-        np[i*nwx+j]=p[(i-dwx)*wx+j-dwx] ; 
-      }
-    }
+void CloneIndex::build()
+{
+  static vector <int> pos ;
+  vector <Genotype*> &node=lca_index.node ;
+  int i,n=node.size() ;
+  end.resize(n) ; first.assign(n+1,0) ; cell.resize(cells.size()) ; origin.clear() ;
+  for (i=0;i<n;i++) end[i]=i+1 ;
+  for (i=n-1;i>0;i--) if (end[lca_index.up[i]]<end[i]) end[lca_index.up[i]]=end[i] ; // children come after their mother
+  for (i=0;i<cells.size();i++) first[genotypes[cells[i].gen]->dfs+1]++ ;
+  for (i=0;i<n;i++) first[i+1]+=first[i] ;
+  pos.assign(first.begin(),first.end()-1) ;
+  for (i=0;i<cells.size();i++) cell[pos[genotypes[cells[i].gen]->dfs]++]=i ;
+  for (i=0;i<n;i++) if (node[i]->no_snps>0) origin.push_back(make_pair(node[i]->snps[0]&L_PM,i)) ; // PMs of a genotype are consecutive
+  sort(origin.begin(),origin.end()) ;
+}
+
+int CloneIndex::find(unsigned int pm)
+{
+  int a=0, b=origin.size() ; // the last origin not after pm is in a..b-1
+  while (b-a>1) { int c=(a+b)/2 ; if (origin[c].first<=pm) a=c ; else b=c ; }
+  if (b==0 || origin[a].first>pm) return -1 ;
+  Genotype *g=lca_index.node[origin[a].second] ;
+  return (pm<origin[a].first+g->no_snps ? origin[a].second : -1) ;
+}
+
+int CloneIndex::no_genotypes(int i)
+{
+  int n=0 ;
+  for (int j=i;j<end[i];j++) if (lca_index.node[j]->number>0) n++ ;
+  return n ;
+}
+
+CloneExtent CloneIndex::extent(int i)
+{
+  CloneExtent e ;
+  double r2=0 ;
+  int j, n=no_cells(i) ;
+  e.lo=IVec(1<<30,1<<30,1<<30) ; e.hi=IVec(-(1<<30),-(1<<30),-(1<<30)) ;
+  for (j=first[i];j<first[end[i]];j++) {
+    IVec r ; cell_position(cell[j],r) ;
+    e.mean.x+=r.i ; e.mean.y+=r.j ; e.mean.z+=r.k ; r2+=r.i*r.i+r.j*r.j+r.k*r.k ;
+    e.lo.i=MIN(e.lo.i,r.i) ; e.lo.j=MIN(e.lo.j,r.j) ; e.lo.k=MIN(e.lo.k,r.k) ;
+    e.hi.i=MAX(e.hi.i,r.i) ; e.hi.j=MAX(e.hi.j,r.j) ; e.hi.k=MAX(e.hi.k,r.k) ;
   }
-#endif
+  if (n>0) { 
+    e.mean.x/=n ; e.mean.y/=n ; e.mean.z/=n ; 
+    e.rg=sqrt(MAX(0.,r2/n-e.mean.x*e.mean.x-e.mean.y*e.mean.y-e.mean.z*e.mean.z)) ;
+  } else e.rg=0 ;
+  return e ;
+}
 
-  delete [] p ;
-  p=np ;
-  wx=nwx ;
+void cell_position(int i, IVec &r)
+{
+  Lesion *ll=lesions[cells[i].lesion] ;
+  r=IVec(int(cells[i].x+ll->r.x),int(cells[i].y+ll->r.y),int(cells[i].z+ll->r.z)) ;
+}
+
+vector<Genotype*> genotypes ;
+vector<int> free_genotype_ids ;
+GenotypeArena genotype_arena ;
+LcaIndex lca_index ;
+Spectrum spectrum ;
+CloneIndex clone_index ;
+vector<Lesion*> lesions ;
+vector<int> lesion_list, free_lesion_ids ;
+LesionGrid lesion_grid ;
+
+#ifdef PUSHING
+void Lesion::update_wx()
+{
+  int i,j,k;
+  int nwx=int(wx*1.25) ;
+  if (nwx%2==1) nwx++ ; // make sure it's even
+  int dwx=(nwx-wx)/2 ;
+  if (float(nwx)*float(nwx)*float(nwx)>2e9) err("nwx too large",nwx) ;
+
+  int *np=new int[nwx*nwx*nwx] ; BYTE *nc=new BYTE[nwx*nwx*nwx] ; if (np==NULL || nc==NULL) err("out of memory") ;
+  for (i=0;i<nwx*nwx*nwx;i++) { np[i]=-1 ; nc[i]=0 ; }
+  for (i=0;i<wx;i++) for (j=0;j<wx;j++) for (k=0;k<wx;k++) {
+    np[((i+dwx)*nwx+j+dwx)*nwx+k+dwx]=p[site(i,j,k)] ;
+    nc[((i+dwx)*nwx+j+dwx)*nwx+k+dwx]=nocc[site(i,j,k)] ;
+  }
+  delete [] p ; delete [] nocc ;
+  p=np ; nocc=nc ;
 
+  wx=nwx ;
+  set_offsets() ;
 }
+#endif
 
 void Lesion::one_move_step() {
   int i,j;
   double mthis=this->n ;
   for (i=0;i<closest.size();i++) {
-    vecd dr=lesions[closest[i]]->r - this->r ;
-    double r2=squared(dr), sumrad2=SQR(this->rad+lesions[closest[i]]->rad) ;
+    Lesion *l=lesions[closest[i]] ;
+    vecd dr=l->r - this->r ;
+    double r2=squared(dr), sumrad2=SQR(this->rad+l->rad) ;
     if (r2<sumrad2) {
-      double mi=lesions[closest[i]]->n ;
+      double mi=l->n ;
       double disp=(sqrt(sumrad2/r2)-1) ;
       if (fabs(disp)>maxdisp) maxdisp=fabs(disp) ;
       dr*=disp*1.1 ;
       this->r-=dr*mi/(mi+mthis) ;
-      lesions[closest[i]]->r+=dr*mthis/(mi+mthis) ;
+      l->r+=dr*mthis/(mi+mthis) ;
+      lesion_grid.moved(l) ;
     }    
   }
+  lesion_grid.moved(this) ;
+}
+
+inline void erase_id(vector <int> &v, int id) 
+{
+  v.erase(find(v.begin(),v.end(),id)) ;
+}
+
+void LesionGrid::rehash(int l)
+{
+  int i,j ;
+  vector <int> ids ;
+  for (i=0;i<b[l].size();i++) for (j=0;j<b[l][i].size();j++) ids.push_back(b[l][i][j]) ;
+  b[l].clear() ; b[l].resize(ids.size()>32 ? 2*ids.size() : 64) ; // a power of 2 as no[l] doubles
+  for (i=0;i<ids.size();i++) {
+    Lesion *ls=lesions[ids[i]] ;
+    int k=bucket(l,ls->r) ;
+    ls->gbuck=k ; ls->gpos=b[l][k].size() ; b[l][k].push_back(ls->id) ;
+  }
+}
+
+void LesionGrid::insert(Lesion *ls)
+{
+  int l=level(ls->rad) ;
+  if (no[l]>=b[l].size()) rehash(l) ;
+  int k=bucket(l,ls->r) ;
+  ls->glev=l ; ls->gbuck=k ; ls->gpos=b[l][k].size() ; b[l][k].push_back(ls->id) ; no[l]++ ; ls->gdirty=0 ;
+}
+
+void LesionGrid::remove(Lesion *ls)
+{
+  vector <int> &v=b[ls->glev][ls->gbuck] ;
+  int last=v.back() ;
+  v[ls->gpos]=last ; lesions[last]->gpos=ls->gpos ; v.pop_back() ; no[ls->glev]-- ;
+}
+
+void LesionGrid::update(Lesion *ls)
+{
+  ls->gdirty=0 ;
+  int l=level(ls->rad) ;
+  if (l==ls->glev && bucket(l,ls->r)==ls->gbuck) return ;
+  remove(ls) ; insert(ls) ;
+}
+
+void LesionGrid::query(Lesion *ls, vector <int> &c)
+{
+  int l,i,j,k,x0,x1,y0,y1,z0,z1 ;
+  for (i=0;i<dirty.size();i++) if (lesions[dirty[i]]!=NULL && lesions[dirty[i]]->gdirty) update(lesions[dirty[i]]) ; // the id may have been reused
+  dirty.clear() ;
+  c.clear() ;
+  for (l=0;l<NLEV;l++) if (no[l]>0) {
+    double w=width(l), d=sqrt(2.)*(ls->rad+(4<<l)) ; // find_closest needs distances<sqrt(2)*(sum of radii)
+    x0=int(floor((ls->r.x-d)/w)) ; x1=int(floor((ls->r.x+d)/w)) ;
+    y0=int(floor((ls->r.y-d)/w)) ; y1=int(floor((ls->r.y+d)/w)) ;
+    z0=int(floor((ls->r.z-d)/w)) ; z1=int(floor((ls->r.z+d)/w)) ;
+    int mask=b[l].size()-1 ;
+    if (double(x1-x0+1)*(y1-y0+1)*(z1-z0+1)>=b[l].size()) { // cheaper to go through all buckets
+      for (i=0;i<b[l].size();i++) c.insert(c.end(),b[l][i].begin(),b[l][i].end()) ;
+    } else {
+      for (i=x0;i<=x1;i++) for (j=y0;j<=y1;j++) for (k=z0;k<=z1;k++) {
+        vector <int> &v=b[l][hash(i,j,k)&mask] ;
+        c.insert(c.end(),v.begin(),v.end()) ;
+      }
+    }
+  }
 }
 
 void Lesion::find_closest() 
 {
+  static vector <int> c, sl ;
+  int i ;
   rold=r ;
+  for (i=0;i<closest.size();i++) erase_id(lesions[closest[i]]->near,id) ;
   closest.clear() ;
-  for (int i=0;i<lesions.size();i++) {
-    vecd dr=this->r - lesions[i]->r ;
+  lesion_grid.query(this,c) ;
+  sl.clear() ;
+  for (i=0;i<c.size();i++) {
+    Lesion *l=lesions[c[i]] ;
+    vecd dr=this->r - l->r ;
     double r2=squared(dr) ;
-    if (r2>0 && r2<2*(SQR(this->rad+lesions[i]->rad))) {
-      closest.push_back(i) ;
-    }
+    if (r2>0 && r2<2*(SQR(this->rad+l->rad))) sl.push_back(l->slot) ;
   }  
+  sort(sl.begin(),sl.end()) ; // keep the order of lesion_list
+  for (i=0;i<sl.size();i++) if (i==0 || sl[i]!=sl[i-1]) {
+    Lesion *l=lesions[lesion_list[sl[i]]] ;
+    closest.push_back(l->id) ;
+    l->near.push_back(id) ;
+  }
+}
+
+Lesion *add_lesion(int cellno, int g, int x, int y, int z)
+{
+  int id ;
+  if (free_lesion_ids.size()>0) { id=free_lesion_ids.back() ; free_lesion_ids.pop_back() ; }
+  else { id=lesions.size() ; lesions.push_back(NULL) ; }
+  Lesion *l=new Lesion(id,cellno,g,x,y,z) ;
+  lesions[id]=l ; l->slot=lesion_list.size() ; lesion_list.push_back(id) ;
+  lesion_grid.insert(l) ;
+  return l ;
+}
+
+void remove_lesion(Lesion *l) // the ids of other lesions and of their cells do not change
+{
+  int i ;
+  for (i=0;i<l->near.size();i++) erase_id(lesions[l->near[i]]->closest,l->id) ;
+  for (i=0;i<l->closest.size();i++) erase_id(lesions[l->closest[i]]->near,l->id) ;
+  int last=lesion_list.back() ;
+  lesion_list[l->slot]=last ; lesions[last]->slot=l->slot ; lesion_list.pop_back() ;
+  lesion_grid.remove(l) ;
+  lesions[l->id]=NULL ; free_lesion_ids.push_back(l->id) ;
+  delete l ;
+}
+
+int add_genotype(Genotype *g)
+{
+  int id ;
+  if (free_genotype_ids.size()>0) { id=free_genotype_ids.back() ; free_genotype_ids.pop_back() ; genotypes[id]=g ; }
+  else { id=genotypes.size() ; genotypes.push_back(g) ; }
+  return id ;
+}
+
+void remove_genotype(int id) // when the last cell of genotype id is gone; the node stays while it has descendants
+{
+  release(genotypes[id]) ; genotypes[id]=NULL ; free_genotype_ids.push_back(id) ;
+}
+
+void compact_genotypes() // removes unused ids keeping the order of genotypes[], cells[].gen are renumbered
+{
+  vector <gen_t> nid(genotypes.size()) ;
+  int i,j=0 ;
+  for (i=0;i<genotypes.size();i++) if (genotypes[i]!=NULL) { nid[i]=j ; genotypes[j++]=genotypes[i] ; }
+  genotypes.resize(j) ; free_genotype_ids.clear() ;
+  for (i=0;i<cells.size();i++) cells.key[i].gen=nid[cells.key[i].gen] ;
+}
+
+int reduce_overlap_jacobi() // lesions move all at once, each by the sum of its pair displacements 
+{
+  static vector <double> x,y,z,rad,m,dx,dy,dz ; // per lesion in the order of lesion_list
+  static vector < vector <int> > nb ; // neighbours of slot a: closest plus near, without repetitions
+  static vector <int> stamp, far, rows ; // far: slots which moved by more than their radius, rows: neighbour lists to be made again
+  static vector <char> moved ; // 1 if slot a moved in a sweep, 2 if also by more than its radius
+  int a,b,i,k,nl=lesion_list.size(),sweeps=0,tag=0 ;
+  x.resize(nl) ; y.resize(nl) ; z.resize(nl) ; rad.resize(nl) ; m.resize(nl) ; dx.resize(nl) ; dy.resize(nl) ; dz.resize(nl) ; 
+  nb.resize(nl) ; moved.resize(nl) ; stamp.assign(nl,-1) ; rows.clear() ;
+  for (a=0;a<nl;a++) {
+    Lesion *l=lesions[lesion_list[a]] ;
+    x[a]=l->r.x ; y[a]=l->r.y ; z[a]=l->r.z ; rad[a]=l->rad ; m[a]=l->n ;
+    rows.push_back(a) ;
+  }
+  do {
+    for (i=0;i<rows.size();i++) { // only the lists changed by find_closest() since the last sweep
+      a=rows[i] ; tag++ ;
+      Lesion *l=lesions[lesion_list[a]] ;
+      nb[a].clear() ;
+      for (k=0;k<l->closest.size();k++) { b=lesions[l->closest[k]]->slot ; stamp[b]=tag ; nb[a].push_back(b) ; }
+      for (k=0;k<l->near.size();k++) { b=lesions[l->near[k]]->slot ; if (stamp[b]!=tag) nb[a].push_back(b) ; }
+    }
+    double maxd=0 ;
+#pragma omp parallel for reduction(max:maxd) private(k) schedule(dynamic,256)
+    for (a=0;a<nl;a++) {
+      const int *n=nb[a].data(), nn=nb[a].size() ;
+      double sx=0,sy=0,sz=0,md=0 ;
+#pragma omp simd reduction(+:sx,sy,sz) reduction(max:md)
+      for (k=0;k<nn;k++) {
+        int b=n[k] ;
+        double ex=x[b]-x[a], ey=y[b]-y[a], ez=z[b]-z[a] ;
+        double r2=ex*ex+ey*ey+ez*ez, s2=SQR(rad[a]+rad[b]) ;
+        double disp=(r2<s2 ? sqrt(s2/r2)-1 : 0) ;
+        md=MAX(md,disp) ;
+        double f=disp*1.1*m[b]/(m[a]+m[b]) ;
+        sx-=ex*f ; sy-=ey*f ; sz-=ez*f ;
+      }
+      dx[a]=sx ; dy[a]=sy ; dz[a]=sz ; 
+      maxd=MAX(maxd,md) ;
+    }
+#pragma omp parallel for schedule(static)
+    for (a=0;a<nl;a++) {
+      moved[a]=0 ;
+      if (dx[a]!=0 || dy[a]!=0 || dz[a]!=0) {
+        x[a]+=dx[a] ; y[a]+=dy[a] ; z[a]+=dz[a] ;
+        Lesion *l=lesions[lesion_list[a]] ;
+        l->r=vecd(x[a],y[a],z[a]) ;
+        vecd dr=l->r - l->rold ; 
+        moved[a]=1+(squared(dr)>SQR(l->rad)) ; // 2 if its neighbours have to be found again
+      }
+    }
+    far.clear() ; rows.clear() ;
+    for (a=0;a<nl;a++) if (moved[a]) { 
+      lesion_grid.moved(lesions[lesion_list[a]]) ; 
+      if (moved[a]==2) far.push_back(a) ; 
+    }
+    tag++ ;
+    for (i=0;i<far.size();i++) { // not thread safe, but rare; the lists of the old and new closest lesions change too 
+      Lesion *l=lesions[lesion_list[far[i]]] ;
+      for (int pass=0;pass<2;pass++) {
+        if (stamp[far[i]]!=tag) { stamp[far[i]]=tag ; rows.push_back(far[i]) ; }
+        for (k=0;k<l->closest.size();k++) { b=lesions[l->closest[k]]->slot ; if (stamp[b]!=tag) { stamp[b]=tag ; rows.push_back(b) ; } }
+        if (pass==0) l->find_closest() ;
+      }
+    }
+    Lesion::maxdisp=maxd ; sweeps++ ;
+  } while (Lesion::maxdisp>1e-2) ;
+  return sweeps ;
 }
 
-void Lesion::reduce_overlap()
+int Lesion::reduce_overlap()
 {
-  int i,j,k,temp ;
-  int *ind=new int[lesions.size()] ;
-  for (j=0;j<lesions.size();j++) ind[j]=j ;
+  if (overlap_solver==O_JACOBI) return reduce_overlap_jacobi() ;
+  int i,j,k,temp,sweeps=0 ;
+  int nl=lesion_list.size() ;
+  int *ind=new int[nl] ;
+  for (j=0;j<nl;j++) ind[j]=lesion_list[j] ;
   do {
     maxdisp=0 ;
-    for (j=0;j<lesions.size();j++) { k=_drand48()*lesions.size() ; SWAP(ind[j],ind[k]) ; }
-    for (j=0;j<lesions.size();j++) {  // go through a random permutation
+    for (j=0;j<nl;j++) { k=_drand48()*nl ; SWAP(ind[j],ind[k]) ; }
+    for (j=0;j<nl;j++) {  // go through a random permutation
       i=ind[j] ; 
       lesions[i]->one_move_step() ; 
         
       vecd dr=lesions[i]->r - lesions[i]->rold ; 
       if (squared(dr)>SQR(lesions[i]->rad)) lesions[i]->find_closest() ; 
     }    
+    sweeps++ ;
   } while (maxdisp>1e-2) ;  
   delete [] ind ;
+  return sweeps ;
 }  
 
 void reset() 
 {
   tt=0 ; L=0 ; max_growth_rate=growth0 ;
   treatment=0 ; 
-  for (int i=0;i<genotypes.size();i++) if (genotypes[i]!=NULL) delete genotypes[i] ;
-  genotypes.clear() ; genotypes.push_back(new Genotype) ;  
-  for (int i=0;i<lesions.size();i++) delete lesions[i] ;
-  lesions.clear() ;
+  genotype_arena.clear() ; genotypes.clear() ; free_genotype_ids.clear() ; // all genotypes go at once, no need to release them
+  spectrum.clear() ;
+  mutation_sampler.restart() ;
+  add_genotype(new Genotype) ;  
+  for (int i=0;i<lesion_list.size();i++) delete lesions[lesion_list[i]] ;
+  lesions.clear() ; lesion_list.clear() ; free_lesion_ids.clear() ; lesion_grid.clear() ;
   cells.clear() ; volume=0 ;
+  events=0 ; events_clock=clock() ;
   drivers.clear() ;
-  lesions.push_back(new Lesion(0,0, 0,0,0)) ;
+  add_lesion(0,0, 0,0,0) ;
   
   // erase output buffer for "times"
 #if defined __linux
@@ -386,12 +775,54 @@ void reset()
 #endif
 }
 
+double wall_time() // in seconds, unlike clock() which adds up the CPU time of all threads
+{
+#ifdef _OPENMP
+  return omp_get_wtime() ;
+#else
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count() ;
+#endif
+}
+
+void bench_overlap() // both overlap solvers on the same random clusters of 1e3..1e5 overlapping lesions
+{
+  int sizes[3]={1000,10000,100000}, solver0=overlap_solver, threads=1 ;
+#ifdef _OPENMP
+  threads=omp_get_max_threads() ;
+#endif
+  for (int si=0;si<3;si++) {
+    int i,j,nl=sizes[si],sweeps[2] ;
+    double secs[2] ;
+    vector <vecd> r0 ;
+    reset() ; 
+    double side=5.2*pow(nl,1./3) ; // volume fraction of lesions ~0.3
+    for (i=1;i<nl;i++) { 
+      Lesion *l=add_lesion(cells.size(),0,0,0,0) ;
+      l->rad=l->rad0=1+2*_drand48() ; l->n=l->n0=int(l->rad*l->rad*l->rad)+1 ;
+    }
+    for (i=0;i<nl;i++) r0.push_back(vecd(side*_drand48(),side*_drand48(),side*_drand48())) ;
+    for (j=0;j<2;j++) { 
+      for (i=0;i<nl;i++) { Lesion *l=lesions[lesion_list[i]] ; l->r=l->rinit=r0[i] ; lesion_grid.moved(l) ; }
+      for (i=0;i<nl;i++) lesions[lesion_list[i]]->find_closest() ;
+      overlap_solver=(j==0 ? O_GAUSS_SEIDEL : O_JACOBI) ;
+      double t0=wall_time() ;
+      sweeps[j]=lesions[lesion_list[0]]->reduce_overlap() ;
+      secs[j]=wall_time()-t0 ;
+    }
+    printf("%d lesions, %d threads:  gauss-seidel %d sweeps %.3g s   jacobi %d sweeps %.3g s\n",nl,threads,sweeps[0],secs[0],sweeps[1],secs[1]) ; fflush(stdout) ;
+  }
+  overlap_solver=solver0 ;
+  reset() ;
+}
+
 #ifdef MOORE_NEIGHBOURHOOD
 const int _nonn=26 ;
+
 const int kx[27]={0,1,1,0,-1,-1,-1,0,1,0,1,1,0,-1,-1,-1,0,1,0,1,1,0,-1,-1,-1,0,1},
           ky[27]={0,0,1,1,1,0,-1,-1,-1,0,0,1,1,1,0,-1,-1,-1,0,0,1,1,1,0,-1,-1,-1},
           kz[27]={0,0,0,0,0,0,0,0,0,-1,-1,-1,-1,-1,-1,-1,-1,-1,1,1,1,1,1,1,1,1,1};
 int kln[27] ; // this is filled with lengths of (kx,ky,kz)
+int kbit[27] ; // this is filled with the bits of (kx,ky,kz) in Lattice::box()
 #endif
 
 #ifdef VON_NEUMANN_NEIGHBOURHOOD
@@ -400,7 +831,9 @@ const int kx[7]={0,1,-1,0,0,0,0},
           ky[7]={0,0,0,1,-1,0,0},
           kz[7]={0,0,0,0,0,1,-1};
 int kln[7] ; // this is filled with lengths of (kx,ky,kz)
+int kbit[7] ; // this is filled with the bits of (kx,ky,kz) in Lattice::box()
 #endif
+unsigned int nnmask ; // all kbit[1.._nonn] as a mask of Lattice::box()
 
 
 
@@ -408,6 +841,9 @@ void init()
 {
   int i,j,k;
   for (i=0;i<=_nonn;i++) kln[i]=sqrt(1.*SQR(kx[i])+1.*SQR(ky[i])+1.*SQR(kz[i])) ;
+  for (i=0;i<=_nonn;i++) kbit[i]=9*(kz[i]+1)+3*(ky[i]+1)+kx[i]+1 ;
+  for (nnmask=0,i=1;i<=_nonn;i++) nnmask|=1<<kbit[i] ;
+  mutation_sampler.init() ;
 
   char txt[256] ;
   sprintf(txt,"mkdir %s",DIR.c_str()) ; system(txt) ;
@@ -416,36 +852,97 @@ void init()
   setvbuf (times , timesbuffer , _IOFBF , (1<<16));  // this is to prevent saving data if no fflush is attempted 
                                                   // (this e.g. allows one to discard N<256)
   start_clock=clock() ;
+#ifndef PUSHING
+  Lattice::index=(method==M_GILLESPIE) ; // Gillespie needs to know which cell sits where
+  Lattice::nbmask=0 ;
+  if (method!=M_NORMAL || death_rule==D_SURFACE || core_is_dead) Lattice::nbmask=nnmask ; // these read no_free_sites() in every event
+#endif
 }
 
 void end() {
   fclose(times) ; 
 }
 
+void bench_rng() // both generators with and without the buffer: draws/s, Poisson draws/s, and events/s of a NORMAL run to 1e6 cells
+{
+  int type0=rng_type, method0=method, t, b, i ;
+  const char *names[2]={"philox","drand48"} ;
+  for (t=0;t<2;t++) for (b=0;b<2;b++) {
+    rng_type=t ; rng.buffer(b ? Rng::BUF : 2) ; _srand48(RAND) ;
+    double s=0 ; 
+    clock_t t0=clock() ;
+    for (i=0;i<100000000;i++) s+=_drand48() ;
+    double secs=1.*(clock()-t0)/CLOCKS_PER_SEC ;
+    printf("%s %s: %.3g draws/s  (mean %f)\n",names[t],b ? "buffered" : "unbuffered",1e8/secs,s/1e8) ; fflush(stdout) ;
+  }
+  double means[3]={0.01,1,100} ;
+  for (t=0;t<3;t++) for (b=0;b<3;b++) { // product method, table or PTRS, countdown of MutationSampler
+    rng_type=(t==0 ? R_DRAND48 : R_PHILOX) ; rng.buffer(Rng::BUF) ; _srand48(RAND) ;
+    MutationSampler ms ; ms.set_mean(means[b]) ; ms.restart() ;
+    double s=0, s2=0 ;
+    clock_t t0=clock() ;
+    for (i=0;i<10000000;i++) { int k=(t==2 ? ms.no_snps() : ms.number.draw()) ; s+=k ; s2+=1.*k*k ; }
+    double secs=1.*(clock()-t0)/CLOCKS_PER_SEC ;
+    printf("poisson(%g) %s: %.3g draws/s  (mean %f var %f)\n",means[b],t==0 ? "product" : (t==2 && ms.skip ? "countdown" : (ms.number.table ? "table" : "ptrs")),1e7/secs,s/1e7,s2/1e7-SQR(s/1e7)) ; fflush(stdout) ;
+  }
+  method=M_NORMAL ;
+  double rate[2][2] ;
+  for (t=0;t<2;t++) for (b=0;b<2;b++) {
+    rng_type=t ; rng.buffer(b ? Rng::BUF : 2) ; _srand48(RAND) ;
+    clock_t t0 ;
+    do { reset() ; t0=clock() ; } while (main_proc(1000000,-1,-1,-1)==1) ;
+    rate[t][b]=events/(1.*(clock()-t0)/CLOCKS_PER_SEC) ;
+  }
+  for (t=0;t<2;t++) printf("%s: %.3g events/s unbuffered, %.3g events/s buffered\n",names[t],rate[t][0],rate[t][1]) ;
+  rng_type=type0 ; method=method0 ; rng.buffer(Rng::BUF) ; _srand48(RAND) ;
+  reset() ;
+}
+
 #ifdef PUSHING
+void Lesion::set_offsets()
+{
+  for (int n=0;n<=_nonn;n++) nd[n]=site(kz[n],ky[n],kx[n]) ;
+}
+
+void Lesion::set_cell(int s, int cellno) // puts cellno (or -1) at site s and updates the neighbour counts
+{
+  int d=(cellno!=-1)-(p[s]!=-1) ;
+  p[s]=cellno ;
+  if (d!=0) {
+    for (int n=1;n<=_nonn;n++) nocc[s+nd[n]]+=d ;
+    int r2=SQR(s/(wx*wx)-wx/2)+SQR((s/wx)%wx-wx/2)+SQR(s%wx-wx/2) ;
+    if (d>0) rh.add(r2) ; else rh.remove(r2) ;
+  }
+}
+
 inline int Lesion::no_free_sites(int x, int y, int z)
 {
-  int nfree=_nonn ;
-  for (int n=1;n<=_nonn;n++) nfree-=p[(wx+z+kz[n])%wx][(wx+y+ky[n])%wx][(wx+x+kx[n])%wx]==-1?0:1 ;
-  return nfree ;
+  return _nonn-nocc[site(z,y,x)] ;
 }
 #else
 inline int Lesion::no_free_sites(int x, int y, int z)
 {
+  if (Lattice::nbmask) return _nonn-*p.count(x,y,z) ;
+#ifdef MOORE_NEIGHBOURHOOD
+  return _nonn-p.count_box(x,y,z) ;
+#else
   int nfree=_nonn ;
-  for (int n=1;n<=_nonn;n++)
-    nfree-=p[((wx+z+kz[n])%wx)*wx + (wx+y+ky[n])%wx]->is_set((wx+x+kx[n])%wx) ;
+  unsigned int m=p.box(x,y,z) ;
+  for (int n=1;n<=_nonn;n++) nfree-=(m>>kbit[n])&1 ;
   return nfree ;
+#endif
 }
-inline void Lesion::choose_nn(int &x, int &y, int &z)
+inline void Lesion::choose_nn(int &x, int &y, int &z) // moves (x,y,z) to a random empty neighbour, x=-1000000 if there is none
 {
-  static int nns[_nonn] ;
-  int no=0,n ;
-  for (n=1;n<=_nonn;n++)
-    if (p[((wx+z+kz[n])%wx)*wx + (wx+y+ky[n])%wx]->is_set((wx+x+kx[n])%wx)==0) nns[no++]=n ;
+  unsigned int m=~p.box(x,y,z)&nnmask ; // empty neighbours
+  int no=__builtin_popcount(m), b ;
   if (no==0) { x=-1000000 ; return ; }
-  n=nns[int(_drand48()*no)] ; 
-  z=(wx+z+kz[n])%wx ; y=(wx+y+ky[n])%wx ; x=(wx+x+kx[n])%wx ;
+  int r=int(_drand48()*no) ;
+  if (rng_type==R_DRAND48) { // the r-th in the order of (kx,ky,kz), as in older versions
+    for (b=1;;b++) if (((m>>kbit[b])&1) && r--==0) break ;
+    b=kbit[b] ;
+  } else b=Lattice::select_bit(m,r) ;
+  z+=b/9-1 ; y+=(b/3)%3-1 ; x+=b%3-1 ;
 }
 #endif
 
@@ -492,16 +989,10 @@ void save_data()
   double drv_per_cell=0,drv_per_cell_surf=0, pms_per_cell=0 ;
   double aver_growth_rate=0,av_migr=0 ;
 
-  int *snp_no=new int[L] ; // array of SNPs abundances
-  for (i=0;i<L;i++) { snp_no[i]=0 ; }
-  for (i=0;i<genotypes.size();i++) {
-    if (genotypes[i]!=NULL && genotypes[i]->number>0) {
-      for (int j=0;j<genotypes[i]->sequence.size();j++) snp_no[((genotypes[i]->sequence[j])&L_PM)]+=genotypes[i]->number ;      
-    }
-  }  
-  int snps_det=0 ;
-  for (i=0;i<L;i++) if (snp_no[i]>cutoff*ntot) snps_det++ ;
-  delete [] snp_no ;
+#ifdef COMPACT_GENOTYPES
+  if (free_genotype_ids.size()>genotypes.size()/2) compact_genotypes() ;
+#endif
+  int snps_det=spectrum.detected(cutoff*ntot) ;
 
   for (i=0;i<ntot;i++) {
     Lesion *ll=lesions[cells[i].lesion] ;
@@ -509,15 +1000,15 @@ void save_data()
     double rr=SQR(cells[i].x+ll->r.x)+SQR(cells[i].y+ll->r.x)+SQR(cells[i].z+ll->r.x) ;
     raver+=sqrt(rr) ; raver2+=rr ;
 #ifdef PUSHING
-    if (ll->p[cells[i].z+wx/2][cells[i].y+wx/2][cells[i].x+wx/2]==-1) err("p[][][]=",i) ;
+    if (ll->cell(cells[i].z+wx/2,cells[i].y+wx/2,cells[i].x+wx/2)==-1) err("p[][][]=",i) ;
 #else
-    if (ll->p[(cells[i].z+wx/2)*wx+cells[i].y+wx/2]->is_set(cells[i].x+wx/2)==0) err("save: is_set: ",i) ;
+    if (ll->p.is_set(cells[i].x+wx/2,cells[i].y+wx/2,cells[i].z+wx/2)==0) err("save: is_set: ",i) ;
 #endif
 
     Genotype *g=genotypes[cells[i].gen] ; if (g==NULL) err("g=NULL)") ;
     int free_sites=ll->no_free_sites(cells[i].x+wx/2,cells[i].y+wx/2,cells[i].z+wx/2) ;
     int is_on_surface=(free_sites>0?1:0) ;    
-    pms_per_cell+=g->sequence.size() ;
+    pms_per_cell+=g->length ;
 
     if (g->no_resistant) {
       no_resistant++ ; 
@@ -536,31 +1027,34 @@ void save_data()
   av_migr/=ntot ;
 
   // 1.ntot 2.time  3.#genotypes  4.radius      
-#ifndef CORE_IS_DEAD
-  fprintf(times,"%d %lf %d %lf  ",ntot,tt,genotypes.size(),raver) ; //sqrt(raver2-raver*raver)) ;
-#else
-  fprintf(times,"%d %lf %d %lf  ",volume,tt,genotypes.size(),raver) ; //sqrt(raver2-raver*raver)) ;
-#endif
+  if (!core_is_dead) fprintf(times,"%d %lf %d %lf  ",ntot,tt,genotypes.size(),raver) ; //sqrt(raver2-raver*raver)) ;
+  else fprintf(times,"%d %lf %d %lf  ",volume,tt,genotypes.size(),raver) ; //sqrt(raver2-raver*raver)) ;
   //  5.#cells_surf    6.#metas     7.#resistant  8.#resistant_surf
-  fprintf(times,"%d %d %d %d   ",nsurf,lesions.size(),no_resistant,no_resistant_surf) ;
+  fprintf(times,"%d %d %d %d   ",nsurf,lesion_list.size(),no_resistant,no_resistant_surf) ;
   // 9.#drivers   10.#cells_with_drv  11.#cells_with_drv_surf    12.#drv/cell   13.#der/cell_surf
   fprintf(times,"%d %d %d  %lf %lf  ",drivers.size(),cells_drv,cells_drv_surf,drv_per_cell,drv_per_cell_surf) ;
   // 14.growth_rate(n)   15.av_distance   16.pms_per_cell   17.snps_detected  18.<migr>
   fprintf(times,"%lf\t%f\t%lf %d\t %le\t",aver_growth_rate,average_distance_ij(),pms_per_cell,snps_det,av_migr) ;
   // #MBs   time_taken
-  fprintf(times,"%d %f\n",memory_taken(),float(1.*(clock()-start_clock)/CLOCKS_PER_SEC)) ;
+  fprintf(times,"%d %f  ",memory_taken(),float(1.*(clock()-start_clock)/CLOCKS_PER_SEC)) ;
+  // #genotype_ids_used   #genotype_nodes (with extinct ancestors)
+  fprintf(times,"%d %d\n",genotypes.size()-free_genotype_ids.size(),genotype_arena.nodes) ;
   if (treatment>0 || ntot>512 || ntot==max_size) fflush(times) ; // flush only when size big enough, this allows us to discard runs that died out
 
-  if (ntot>256) { printf("%d %lf   no.les.=%d  no.res=%d drv_cell=%lf max_growth=%lf\n",ntot,tt,lesions.size(),no_resistant, drv_per_cell,max_growth_rate) ; fflush(stdout) ; }
+  if (ntot>256) { 
+    long long int lbytes=0 ; // memory of lesions per occupied site
+    for (int i=0;i<lesion_list.size();i++) lbytes+=lesions[lesion_list[i]]->bytes() ;
+    printf("%d %lf   no.les.=%d  no.res=%d drv_cell=%lf max_growth=%lf events/s=%.3g lesion_bytes/cell=%.1f\n",ntot,tt,lesion_list.size(),no_resistant, drv_per_cell,max_growth_rate,events/(1e-9+1.*(clock()-events_clock)/CLOCKS_PER_SEC),1.*lbytes/volume) ; fflush(stdout) ; 
+  }
 }
 
 void snps_corr(Hist *snps) ;
-void snps_corr_cutoff(Hist *snps,float cutoff,int *snp_no) ;
+void snps_corr_cutoff(Hist *snps,float cutoff) ;
 void snps_corr_cond_driver(Hist *snps) ;
 void find_p_driver(Hist *pr1, Hist *pr2, Hist *pr3) ;
 void save_snp_corr(char *name, Hist *snps);
 
-void save_spatial(int *snp_no)
+void save_spatial() // lca_index must be built
 {
 #ifndef NO_MECHANICS  
   printf("save spatial\n") ;
@@ -574,7 +1068,7 @@ void save_spatial(int *snp_no)
 
   snps_corr(snp_corr) ;
   sprintf(tmp,"%s/corr_%d_%d.dat",DIR.c_str(),RAND,sample) ; save_snp_corr(tmp, snp_corr) ;                
-  snps_corr_cutoff(snp_corr,0.1,snp_no) ;
+  snps_corr_cutoff(snp_corr,0.1) ;
   sprintf(tmp,"%s/cutoff01corr_%d_%d.dat",DIR.c_str(),RAND,sample) ; save_snp_corr(tmp, snp_corr) ;                
 
   if (driver_adv>0 || driver_migr_adv>0) {
@@ -595,125 +1089,237 @@ void save_spatial(int *snp_no)
 }
 
 #ifdef PUSHING
-void Lesion::find_dir_min_drag(int i, int j, int k, int &in, int &jn, int &kn)       // find direction of least drag
+void Lesion::find_dir_min_drag(int i, int j, int k, int &in, int &jn, int &kn, vector <IVec> *path)       // find direction of least drag
 {
-  int nn, in0,jn0,kn0 ;
-  vector <IVec> vis ; // vector of visited sites. it will begin with (i,j,k) and end at empty site
+  int nn, s0, s ;
+  static vector <int> vis ; // vector of visited sites. it will begin with (i,j,k) and end at empty site
+  static vector <unsigned int> stamp ; // stamp[s]==epoch iff site s is in vis, shared by all lesions
+  static unsigned int epoch=0 ;
+  if (stamp.size()<wx*wx*wx) stamp.resize(wx*wx*wx,0) ;
 
 rep:      
+  if (++epoch==0) { fill(stamp.begin(),stamp.end(),0) ; epoch=1 ; } // forget all previous stamps
   vis.clear() ;
-  vis.push_back(IVec(i,j,k)) ;
-  in0=i ; jn0=j ; kn0=k ; 
+  vis.push_back(site(i,j,k)) ;
+  s0=vis[0] ; stamp[s0]=epoch ;
       
   do {      // loop goes over subsequent pushing events
     float mind=wx ;
     nn=-1 ;
     for (int nnnn=0;nnnn<10;nnnn++) {
       int nnn=1+_drand48()*_nonn ;
-      in=in0 ; jn=jn0 ; kn=kn0 ; 
+      s=s0 ;
       for (float drag=0;drag<mind;drag+=kln[nnn]) {
-        in+=kz[nnn] ; jn+=ky[nnn] ; kn+=kx[nnn] ;
-        for (int vv=0;vv<vis.size();vv++) if (vis[vv]==IVec(in,jn,kn)) goto brk ; // reject if trajectory passes through prev. visited sites
-        if (p[in][jn][kn]==-1) { mind=drag ; nn=nnn ; break ; } 
+        s+=nd[nnn] ; // an empty site is always found before the edge of the cube
+        if (stamp[s]==epoch) break ; // reject if trajectory passes through prev. visited sites
+        if (p[s]==-1) { mind=drag ; nn=nnn ; break ; } 
       }
-brk:  continue ;
     }
     if (nn==-1) goto rep ; 
         // now nn gives the direction of pushing
         
-    in0+=kz[nn] ; jn0+=ky[nn] ; kn0+=kx[nn] ; // update position of the cell to be pushed
-    vis.push_back(IVec(in0,jn0,kn0)) ; // and remember it...
-  } while (p[in0][jn0][kn0]!=-1) ; // if the next position contains an empty site then exit
+    s0+=nd[nn] ; // update position of the cell to be pushed
+    vis.push_back(s0) ; stamp[s0]=epoch ; // and remember it...
+  } while (p[s0]!=-1) ; // if the next position contains an empty site then exit
 
   // push all remembered cells except mother to make space for a single new daughter cell
-  Sites sup=-1 ;        // sup is the elevated cell that needs to be inserted into new position
+  int sup=-1 ;        // sup is the elevated cell that needs to be inserted into new position
+  if (path!=NULL) { path->clear() ; path->push_back(IVec(i,j,k)) ; } // sites whose cells have been shifted
   for (int vv=1;vv<vis.size();vv++) {
-    in0=vis[vv].i ; jn0=vis[vv].j ; kn0=vis[vv].k ;  
-    Sites snew=p[in0][jn0][kn0] ;  
-    p[in0][jn0][kn0]=sup ;
+    s0=vis[vv] ;
+    int in0=s0/(wx*wx), jn0=(s0/wx)%wx, kn0=s0%wx ;
+    int snew=p[s0] ;  
+    set_cell(s0,sup) ;
     if (sup!=-1) {
-      Cell *c=&cells[sup] ; 
-      c->x=kn0-wx/2 ; c->y=jn0-wx/2 ; c->z=in0-wx/2 ;
+      CellRef c=cells[sup] ; 
+      c.x=kn0-wx/2 ; c.y=jn0-wx/2 ; c.z=in0-wx/2 ;
     }
+    if (path!=NULL) path->push_back(IVec(in0,jn0,kn0)) ;
     sup=snew ;
   }
 
-  in=vis[1].i ; jn=vis[1].j ; kn=vis[1].k ; // the new cell will be the second position from the list (1st is the mother cell which is not pushed)
-  if (p[in][jn][kn]!=-1) err("!!!") ;
+  in=vis[1]/(wx*wx) ; jn=(vis[1]/wx)%wx ; kn=vis[1]%wx ; // the new cell will be the second position from the list (1st is the mother cell which is not pushed)
+  if (p[vis[1]]!=-1) err("!!!") ;
 }
 #endif
 
 
+
+
 //-----------------------------------------------------
-#if defined(NORMAL)
+// Birth and death rules. rate() returns the rate for a cell with growth (death) rate g and nfree empty neighbours.
+
+struct LinearBirth {
+  static const int rule=B_LINEAR ;
+  static inline float rate(float g, int nfree) { return g*nfree/float(_nonn) ; }
+};
+
+struct ConstBirth {
+  static const int rule=B_CONST ;
+  static inline float rate(float g, int nfree) { if (nfree>0) return g ; else return 0 ; }
+};
+
+struct PushBirth {
+  static const int rule=B_PUSHING ;
+  static inline float rate(float g, int nfree) { return g ; }
+};
+
+struct VolumeDeath {
+  static const int rule=D_VOLUME ;
+  static inline float rate(float d, int nfree) { return d ; }
+};
+
+struct SurfaceDeath {
+  static const int rule=D_SURFACE ;
+  static inline float rate(float d, int nfree) { return d*nfree/float(_nonn) ; }
+};
+
+template <class Birth> inline double birth_rate(int n)
+{
+  return Birth::rate(genotypes[cells[n].gen]->growth[treatment], Birth::rule==B_PUSHING?0:free_sites(n)) ;
+}
 
-int main_proc(int exit_size, int save_size, double max_time, double wait_time)
+template <class Death> inline double death_rate(int n)
+{
+  return Death::rate(genotypes[cells[n].gen]->death[treatment], Death::rule==D_VOLUME?0:free_sites(n)) ;
+}
+
+RateTree rates ; // birth+death rate of each cell, indexed in the same way as cells[], used by the Gillespie method
+
+template <class Birth, class Death> inline void update_rate(int n) 
+{
+  rates.set(n,birth_rate<Birth>(n)+death_rate<Death>(n)) ;
+}
+
+template <class Birth, class Death> void update_rates_near(Lesion *ll, int i, int j, int k) // site (i,j,k) changed, update rates of the cell there and of its neighbours
+{
+#ifdef PUSHING
+  int s=ll->site(i,j,k) ;
+  for (int nn=0;nn<=_nonn;nn++) {
+    int c=ll->cell(s+ll->nd[nn]) ;
+    if (c>=0 && c<cells.size()) update_rate<Birth,Death>(c) ;
+  }
+#else
+  int c[27] ;
+  int no=ll->p.box_cells(k,j,i,ll->p.box(k,j,i)&(Lattice::nbmask|(1<<kbit[0])),c) ; // nbmask is always set for Gillespie
+  for (int nn=0;nn<no;nn++) if (c[nn]>=0 && c[nn]<cells.size()) update_rate<Birth,Death>(c[nn]) ;
+#endif
+}
+
+template <class Birth, class Death> void init_rates()
+{
+  rates.clear(cells.size()) ;
+  for (int n=0;n<cells.size();n++) update_rate<Birth,Death>(n) ;
+}
+
+
+//-----------------------------------------------------
+// main_proc is instantiated for every method and birth/death rule, see the dispatch below
+
+template <int method, class Birth, class Death, int core_dead>
+int main_proc_t(int exit_size, int save_size, double max_time, double wait_time)
 {
   int i,j,k,n,l,in,jn,kn,ntot;  
   int cc=0, timeout=0 ;
   double tt_old=tt ;
+  if (method==M_GILLESPIE) init_rates<Birth,Death>() ; // rates depend on treatment so they are recalculated every time main_proc is called
 
   for(;;) {      // main loop 
+    events++ ;
 #ifdef PAUSE_WHEN_MEMORY_LOW
     timeout++ ; if (timeout>1000000) {
-      timeout=0 ; //printf("xxx") ;
-      while (freemem()<PAUSE_WHEN_MEMORY_LOW) { sleep(1) ; } //printf("%d\n",freemem()) ; }
+      timeout=0 ; 
+      while (freemem()<PAUSE_WHEN_MEMORY_LOW) { sleep(1) ; } 
     }    
 #endif
-    double tsc=0.01*cells.size() ; if (tsc>1./max_growth_rate) tsc=1./max_growth_rate ;
-    tt+=tsc*timescale/cells.size() ; 
-    n=_drand48()*cells.size() ;
-//    if (cells[n].lesion<0 || cells[n].lesion>=cells.size()) err("l=",cells[n].lesion) ;
+    double tsc ;
+    int mode=2 ; // KMC and Gillespie only: 0==birth, 1==death, 2==nothing happens
+    if (method==M_NORMAL) {
+      tsc=0.01*cells.size() ; if (tsc>1./max_growth_rate) tsc=1./max_growth_rate ;
+      tt+=tsc*timescale/cells.size() ; 
+      n=_drand48()*cells.size() ;
+    } else if (method==M_FASTER_KMC) {
+      double max_death_rate=1 ;
+      double tot_rate=cells.size()*(max_growth_rate+max_death_rate) ;
+      tt+=-log(1-_drand48())*timescale/tot_rate ; 
+      n=_drand48()*cells.size() ;
+      double q=_drand48()*(max_growth_rate+max_death_rate) ;
+      double br=birth_rate<Birth>(n), dr=death_rate<Death>(n) ;
+      if (q<br) mode=0 ;
+      else if (q<br+dr) mode=1 ;
+      else mode=2 ;
+    } else { // Gillespie, with rates kept in a sum tree and only updated around the sites which have changed
+      double tot_rate=rates.total() ;
+      tt+=-log(1-_drand48())*timescale/tot_rate ; 
+      double q=_drand48()*tot_rate ;
+      n=rates.find(q) ;
+      if (n>=cells.size()) err("n>=cells.size() at t=",tt) ;
+      mode=(q<birth_rate<Birth>(n)?0:1) ;
+    }
+
     Lesion *ll=lesions[cells[n].lesion] ;
     int wx=ll->wx ; 
     k=cells[n].x+wx/2 ; j=cells[n].y+wx/2 ; i=cells[n].z+wx/2 ; 
-    int need_wx_update=0 ;
-    if (k<2 || k>=ll->wx-3 || j<2 || j>=ll->wx-3 || i<2 || i>=ll->wx-3) need_wx_update=1 ; 
 #ifdef PUSHING
-    if (ll->p[i][j][k]!=n) err("ll->p[i][j][k]!=n, p=",ll->p[i][j][k]) ;
+    int need_wx_update=0 ; // set when a site close to the edge of the cube becomes occupied
+#endif
+    if (method==M_NORMAL) {
+#ifdef PUSHING
+      if (ll->cell(i,j,k)!=n) err("ll->p[i][j][k]!=n, p=",ll->cell(i,j,k)) ;
 #else
-    if (ll->p[i*wx+j]->is_set(k)==0) err("ll->p[i][j][k]==0, wx=",wx) ;
+      if (ll->p.is_set(k,j,i)==0) err("ll->p[i][j][k]==0, wx=",wx) ;
 #endif
+    }
 
-    if (_drand48()<tsc*genotypes[cells[n].gen]->growth[treatment]) { // reproduction
-#if !defined(CONST_BIRTH_RATE) && !defined(PUSHING)
-      int nn=1+int(_drand48()*_nonn) ;
-      int in=(wx+i+kz[nn])%wx, jn=(wx+j+ky[nn])%wx, kn=(wx+k+kx[nn])%wx ;
-#ifdef VON_NEUMANN_NEIGHBOURHOOD_QUADRATIC // one more trial to find an empty site
-      if (ll->p[in*wx+jn]->is_set(kn)==1) {
-        nn=1+int(_drand48()*_nonn) ;
-        in=(wx+i+kz[nn])%wx ; jn=(wx+j+ky[nn])%wx ; kn=(wx+k+kx[nn])%wx ;
-      }
-#endif
-      if (ll->p[in*wx+jn]->is_set(kn)==0) {
-#elif (!defined(PUSHING)) && (defined(CONST_BIRTH_RATE))
+    int birth ;
+    if (method==M_NORMAL) birth=(_drand48()<tsc*genotypes[cells[n].gen]->growth[treatment]) ;
+    else birth=(mode==0) ;
+    if (birth) { // reproduction
       int in=i, jn=j, kn=k ;
-      ll->choose_nn(kn,jn,in) ;
-      if (kn!=-1000000) { // if there is at least one empty n.n., then.....
-#elif defined(PUSHING)
-      int in,jn,kn ;
-      ll->find_dir_min_drag(i,j,k, in,jn,kn) ;
-      {
+#ifdef PUSHING
+      vector <IVec> path ;
+      ll->find_dir_min_drag(i,j,k, in,jn,kn, &path) ;
+      need_wx_update=ll->near_edge(path.back().i,path.back().j,path.back().k) ;
 #else
-  #error inconsistent growth conditions 
+      if (method==M_NORMAL && Birth::rule==B_LINEAR) { // try a random neighbour
+        int nn=1+int(_drand48()*_nonn) ;
+        in=i+kz[nn] ; jn=j+ky[nn] ; kn=k+kx[nn] ;
+#ifdef VON_NEUMANN_NEIGHBOURHOOD_QUADRATIC // one more trial to find an empty site
+        if (ll->p.is_set(kn,jn,in)==1) {
+          nn=1+int(_drand48()*_nonn) ;
+          in=i+kz[nn] ; jn=j+ky[nn] ; kn=k+kx[nn] ;
+        }
+#endif
+        if (ll->p.is_set(kn,jn,in)==1) kn=-1000000 ; 
+      } else ll->choose_nn(kn,jn,in) ;
 #endif
-        int no_SNPs=poisson() ; // newly produced cell mutants
+      if (kn!=-1000000) { // if there is an empty site for the new cell, then.....
+        int no_SNPs=mutation_sampler.no_snps() ; // newly produced cell mutants
         if (_drand48()>genotypes[cells[n].gen]->m[treatment]) { // make a new cell in the same lesion
           Cell c ; c.x=kn-wx/2 ; c.y=jn-wx/2 ; c.z=in-wx/2 ; c.lesion=cells[n].lesion ;
-#ifndef PUSHING
-          ll->p[in*wx+jn]->set(kn) ;
+#ifdef PUSHING
+          ll->set_cell(ll->site(in,jn,kn),cells.size()) ;
 #else
-          ll->p[in][jn][kn]=cells.size() ;
+          ll->occupy(kn,jn,in) ;
+          if (method==M_GILLESPIE) ll->cell(in,jn,kn)=cells.size() ;
 #endif
           if (no_SNPs>0) { 
-            c.gen=genotypes.size() ; genotypes.push_back(new Genotype(genotypes[cells[n].gen],cells[n].gen,no_SNPs)) ; // mutate 
+            c.gen=add_genotype(new Genotype(genotypes[cells[n].gen],no_SNPs)) ; // mutate 
           } else { 
-            c.gen=cells[n].gen ; genotypes[cells[n].gen]->number++ ; 
+            c.gen=cells[n].gen ; add_cells(genotypes[cells[n].gen],1) ; 
           }
           cells.push_back(c) ; volume++ ;
+          if (method==M_GILLESPIE) {
+            update_rates_near<Birth,Death>(ll,in,jn,kn) ;
+#ifdef PUSHING
+            for (int vv=2;vv<path.size();vv++) update_rate<Birth,Death>(ll->cell(path[vv].i,path[vv].j,path[vv].k)) ;
+            update_rates_near<Birth,Death>(ll,path[path.size()-1].i,path[path.size()-1].j,path[path.size()-1].k) ;
+#endif
+          }
+
           ll->n++ ; 
 #ifndef NO_MECHANICS
-          double d=(c.x*c.x+c.y*c.y+c.z*c.z) ; if (d>SQR(ll->rad)) ll->rad=sqrt(d) ;
+          double d=(c.x*c.x+c.y*c.y+c.z*c.z) ; if (d>SQR(ll->rad)) { ll->rad=sqrt(d) ; lesion_grid.moved(ll) ; }
           if (ll->rad/ll->rad0>1.05) {
             ll->reduce_overlap() ;  
             ll->find_closest() ; 
@@ -723,103 +1329,99 @@ int main_proc(int exit_size, int save_size, double max_time, double wait_time)
 #endif
         } else { // make a new lesion
           int x=kn-wx/2+ll->r.x, y=jn-wx/2+ll->r.y, z=in-wx/2+ll->r.z ;
+          Lesion *nl ;
           if (no_SNPs>0) { 
-            genotypes.push_back(new Genotype(genotypes[cells[n].gen],cells[n].gen,no_SNPs)) ;
-            lesions.push_back(new Lesion(cells.size(),genotypes.size()-1,x,y,z)) ;
+            int g=add_genotype(new Genotype(genotypes[cells[n].gen],no_SNPs)) ;
+            nl=add_lesion(cells.size(),g,x,y,z) ;
           } else {
-            genotypes[cells[n].gen]->number++ ; 
-            lesions.push_back(new Lesion(cells.size(),cells[n].gen,x,y,z)) ;
+            add_cells(genotypes[cells[n].gen],1) ; 
+            nl=add_lesion(cells.size(),cells[n].gen,x,y,z) ;
           }        
+          if (method==M_GILLESPIE) update_rate<Birth,Death>(cells.size()-1) ;
 #ifndef NO_MECHANICS
-          lesions[lesions.size()-1]->find_closest() ; 
+          nl->find_closest() ; 
 #endif
         }
 // BOTH_MUTATE          
-        no_SNPs=poisson() ; // old cell mutates
+        no_SNPs=mutation_sampler.no_snps() ; // old cell mutates
         if (no_SNPs>0) { 
-          genotypes[cells[n].gen]->number-- ; 
-          int pn=genotypes.size() ; genotypes.push_back(new Genotype(genotypes[cells[n].gen],cells[n].gen,no_SNPs)) ;
-          cells[n].gen=genotypes.size()-1 ;
-          if (genotypes[cells[n].gen]->number<=0) { 
-            delete genotypes[cells[n].gen] ; genotypes[cells[n].gen]=NULL ; 
-          }
+          int og=cells[n].gen ; add_cells(genotypes[og],-1) ; 
+          cells[n].gen=add_genotype(new Genotype(genotypes[og],no_SNPs)) ;
+          if (genotypes[og]->number<=0) remove_genotype(og) ;
+          if (method==M_GILLESPIE) update_rate<Birth,Death>(n) ;
         }
       }
     }
-#ifdef CORE_IS_DEAD
-    if (ll->no_free_sites(k,j,i)==0) { // remove cell from the core but leave p[i,j,k] set
-      genotypes[cells[n].gen]->number-- ; if (genotypes[cells[n].gen]->number<=0) { 
-        delete genotypes[cells[n].gen] ; genotypes[cells[n].gen]=NULL ; 
-      }
+
+    if (core_dead && ll->no_free_sites(k,j,i)==0) { // remove cell from the core but leave p[i,j,k] set
+      add_cells(genotypes[cells[n].gen],-1) ; if (genotypes[cells[n].gen]->number<=0) remove_genotype(cells[n].gen) ;
       cells[n]=cells[cells.size()-1] ; cells.pop_back() ; 
-    }
+      if (method==M_GILLESPIE) {
+#ifndef PUSHING
+        ll->cell(i,j,k)=-1 ; 
 #endif
+        if (n<cells.size()) {
+          Lesion *ll2=lesions[cells[n].lesion] ;
+          ll2->cell(cells[n].z+ll2->wx/2,cells[n].y+ll2->wx/2,cells[n].x+ll2->wx/2)=n ;
+        }
+        rates.set(cells.size(),0) ; 
+        if (n<cells.size()) update_rate<Birth,Death>(n) ;
+      }
+    }
 
 // now we implement death
+    int death ;
+    if (method==M_NORMAL) {
 //    if (tsc>1./max_growth_rate) tsc=1./max_growth_rate ; // this is an alternative way but it does not change anything so no need to use it
-#ifdef DEATH_ON_SURFACE    
-    if (genotypes[cells[n].gen]->death[treatment]>0 && _drand48()<tsc*genotypes[cells[n].gen]->death[treatment]*ll->no_free_sites(k,j,i)/float(_nonn))  { // death on the surface
-#else
-    if (_drand48()<tsc*genotypes[cells[n].gen]->death[treatment]) { // death in volume
-#endif
-#ifndef PUSHING
-      ll->p[i*wx+j]->unset(k) ;
+      if (Death::rule==D_SURFACE) death=(genotypes[cells[n].gen]->death[treatment]>0 && _drand48()<tsc*genotypes[cells[n].gen]->death[treatment]*ll->no_free_sites(k,j,i)/float(_nonn)) ; // death on the surface
+      else death=(_drand48()<tsc*genotypes[cells[n].gen]->death[treatment]) ; // death in volume
+    } else death=(mode==1) ;
+    if (death) {
+#ifdef PUSHING
+      ll->set_cell(ll->site(i,j,k),-1) ;
 #else
-      ll->p[i][j][k]=-1 ;
+      ll->vacate(k,j,i) ;
 #endif
       ll->n-- ; 
+      int ii=i, jj=j, kk=k ; // i,j,k are reused below
 //      if (ll->n<0) err("ll->n<0") ;
 #ifndef NO_MECHANICS
       if (ll->n>1000 && 1.*ll->n/ll->n0<0.9) { // recalculate radius
-        ll->rad=0 ; 
-        for (i=0;i<wx;i++) for (j=0;j<wx;j++) for (k=0;k<wx;k++) {
-#ifndef PUSHING
-          double d=SQR(i-wx/2)+SQR(j-wx/2)+SQR(k-wx/2) ; if (ll->p[i*wx+j]->is_set(k) && d>SQR(ll->rad)) ll->rad=sqrt(d) ; 
-#else
-          double d=SQR(i-wx/2)+SQR(j-wx/2)+SQR(k-wx/2) ; if (ll->p[i][j][k]!=-1 && d>SQR(ll->rad)) ll->rad=sqrt(d) ; 
-#endif
-        }
+        ll->rad=sqrt(double(ll->rh.max)) ; lesion_grid.moved(ll) ;
         ll->rad0=ll->rad ; ll->n0=ll->n ;
       }
 #endif
       if (ll->n==0) {
-        int nn=cells[n].lesion ;
-//        if (ll!=lesions[nn]) err("ll!") ;
-        ll=NULL ; 
-        delete lesions[nn] ; 
-        if (nn!=lesions.size()-1) { // move lesion to a different index, and change cells->lesion correspondingly
-          for (i=0;i<cells.size();i++) if (cells[i].lesion==lesions.size()-1) cells[i].lesion=nn ;
-          lesions[nn]=lesions[lesions.size()-1] ; 
-        }        
-        lesions.pop_back() ;        
-#ifndef NO_MECHANICS
-        for (i=0;i<lesions.size();i++) {
-          lesions[i]->find_closest() ;  
-        }
-#endif 
-      }
-      genotypes[cells[n].gen]->number-- ; if (genotypes[cells[n].gen]->number<=0) { 
-        delete genotypes[cells[n].gen] ; genotypes[cells[n].gen]=NULL ; 
+        remove_lesion(ll) ; ll=NULL ; 
       }
+      add_cells(genotypes[cells[n].gen],-1) ; if (genotypes[cells[n].gen]->number<=0) remove_genotype(cells[n].gen) ;
       if (n!=cells.size()-1) { 
         cells[n]=cells[cells.size()-1] ;
 #ifdef PUSHING
         Lesion *ll2=lesions[cells[n].lesion] ;
-        int ii=cells[n].z+ll2->wx/2, jj=cells[n].y+ll2->wx/2, kk=cells[n].x+ll2->wx/2 ;
-        ll2->p[ii][jj][kk]=n ;
+        ll2->cell(cells[n].z+ll2->wx/2,cells[n].y+ll2->wx/2,cells[n].x+ll2->wx/2)=n ;
+#else
+        if (method==M_GILLESPIE) {
+          Lesion *ll2=lesions[cells[n].lesion] ;
+          ll2->cell(cells[n].z+ll2->wx/2,cells[n].y+ll2->wx/2,cells[n].x+ll2->wx/2)=n ;
+        }
 #endif
       }
       cells.pop_back() ; volume-- ;
+      if (method==M_GILLESPIE) {
+        rates.set(cells.size(),0) ; 
+        if (n<cells.size()) update_rate<Birth,Death>(n) ;
+        if (ll!=NULL) update_rates_near<Birth,Death>(ll,ii,jj,kk) ;
+      }
       //if (lesions.size()==0) err("N=",int(cells.size())) ;
     }
 
+#ifdef PUSHING
     if (need_wx_update && ll!=NULL) ll->update_wx() ;    
-      
-#ifdef CORE_IS_DEAD
-    ntot=volume ;
-#else
-    ntot=cells.size() ;
 #endif
+      
+    if (core_dead) ntot=volume ;
+    else ntot=cells.size() ;
 
     if (wait_time>0 && tt>tt_old+wait_time) { tt_old=tt ; save_data(); }
     if (save_size>1 && ntot>=save_size) { save_size*=2 ; save_data() ; }
@@ -831,240 +1433,39 @@ int main_proc(int exit_size, int save_size, double max_time, double wait_time)
   }
 
 }
-#endif // NORMAL
-
-
-//-----------------------------------------------------------------------------
 
-#if defined(FASTER_KMC) || defined(GILLESPIE)
+// dispatch happens once per call so that the main loop is compiled separately for each combination
 
-int main_proc(int exit_size, int save_size, double max_time, double wait_time)
+template <int method, class Birth, class Death>
+int main_proc_c(int exit_size, int save_size, double max_time, double wait_time)
 {
-  int i,j,k,n,l,in,jn,kn,ntot;  
-  int cc=0, timeout=0 ;
-  double tt_old=tt ;
-
-  for(;;) {      // main loop 
-#ifdef PAUSE_WHEN_MEMORY_LOW
-    timeout++ ; if (timeout>1000000) {
-      timeout=0 ; 
-      while (freemem()<PAUSE_WHEN_MEMORY_LOW) { sleep(1) ; } 
-    }    
-#endif
-
-#ifdef GILLESPIE
-  // Gillespie
-    double tot_rate=0 ;
-    for (n=0;n<cells.size();n++) {
-#if !defined(CONST_BIRTH_RATE) && !defined(PUSHING)
-      tot_rate+=genotypes[cells[n].gen]->growth[treatment] * free_sites(n)/float(_nonn) ;
-#elif (!defined(PUSHING)) && (defined(CONST_BIRTH_RATE))
-      if (free_sites(n)>0) tot_rate+=genotypes[cells[n].gen]->growth[treatment] ;
-#elif defined(PUSHING)
-      tot_rate+=genotypes[cells[n].gen]->growth[treatment] ;
-#else
-      #error inconsistent growth conditions 
-#endif
-#ifdef DEATH_ON_SURFACE    
-      tot_rate+=genotypes[cells[n].gen]->death[treatment] * free_sites(n)/float(_nonn) ; // death on the surface
-#else
-      tot_rate+=genotypes[cells[n].gen]->death[treatment] ;  // death in volume
-#endif
-    }        
-    tt+=-log(1-_drand48())*timescale/tot_rate ; 
-    double q=_drand48()*tot_rate,r=0 ;
-    int mode=0 ;
-    for (n=0;n<cells.size();n++) {
-#if !defined(CONST_BIRTH_RATE) && !defined(PUSHING)
-      r+=genotypes[cells[n].gen]->growth[treatment] * free_sites(n)/float(_nonn) ;
-#elif (!defined(PUSHING)) && (defined(CONST_BIRTH_RATE))
-      if (free_sites(n)>0) r+=genotypes[cells[n].gen]->growth[treatment] ;
-#elif defined(PUSHING)
-      r+=genotypes[cells[n].gen]->growth[treatment] ;
-#else
-      #error inconsistent growth conditions 
-#endif
-      if (r>q) break ;
-#ifdef DEATH_ON_SURFACE    
-      r+=genotypes[cells[n].gen]->death[treatment] * free_sites(n)/float(_nonn)  ; // death on the surface
-#else
-      r+=genotypes[cells[n].gen]->death[treatment] ;  // death in volume
-#endif
-      if (r>q) { mode=1 ; break ; }
-    }
-    if (n==cells.size()) err("n==cells.size() at t=",tt) ;
-#endif
-
-#ifdef FASTER_KMC
-    double max_death_rate=1 ;
-    double tot_rate=cells.size()*(max_growth_rate+max_death_rate) ;
-    tt+=-log(1-_drand48())*timescale/tot_rate ; 
-    n=_drand48()*cells.size() ;
-    double q=_drand48()*(max_growth_rate+max_death_rate), br,dr  ;
-    int mode=0 ; 
-#if !defined(CONST_BIRTH_RATE) && !defined(PUSHING)
-    br=genotypes[cells[n].gen]->growth[treatment] * free_sites(n)/float(_nonn) ;
-#elif (!defined(PUSHING)) && (defined(CONST_BIRTH_RATE))
-    if (free_sites(n)>0) br=genotypes[cells[n].gen]->growth[treatment] ; else br=0 ;
-#elif defined(PUSHING)
-    br=genotypes[cells[n].gen]->growth[treatment] ;
-#else
-      #error inconsistent growth conditions 
-#endif
-#ifdef DEATH_ON_SURFACE    
-    dr=genotypes[cells[n].gen]->death[treatment] * free_sites(n)/float(_nonn) ; // death on the surface
-#else
-    dr=genotypes[cells[n].gen]->death[treatment] ;  // death in volume
-#endif
-    if (q<br) mode=0 ;
-    else if (q<br+dr) mode=1 ;
-    else mode=2 ;
-#endif    
-
-    Lesion *ll=lesions[cells[n].lesion] ;
-    int wx=ll->wx ; 
-    k=cells[n].x+wx/2 ; j=cells[n].y+wx/2 ; i=cells[n].z+wx/2 ; 
-    int need_wx_update=0 ;
-    if (k<2 || k>=ll->wx-3 || j<2 || j>=ll->wx-3 || i<2 || i>=ll->wx-3) need_wx_update=1 ; 
-
-    if (mode==0) { // reproduction
-#if !defined(PUSHING)
-      int in=i, jn=j, kn=k ;
-      ll->choose_nn(kn,jn,in) ;
-#else
-      int in,jn,kn ;
-      ll->find_dir_min_drag(i,j,k, in,jn,kn) ;      
-#endif
-
-      int no_SNPs=poisson() ; // newly produced cell mutants
-      if (_drand48()>genotypes[cells[n].gen]->m[treatment]) { // make a new cell in the same lesion
-        Cell c ; c.x=kn-wx/2 ; c.y=jn-wx/2 ; c.z=in-wx/2 ; c.lesion=cells[n].lesion ;
-#ifdef PUSHING
-        ll->p[in][jn][kn]=cells.size() ;
-#else
-        ll->p[in*wx+jn]->set(kn) ;
-#endif
-        if (no_SNPs>0) { 
-          c.gen=genotypes.size() ; genotypes.push_back(new Genotype(genotypes[cells[n].gen],cells[n].gen,no_SNPs)) ; // mutate 
-        } else { 
-          c.gen=cells[n].gen ; genotypes[cells[n].gen]->number++ ; 
-        }
-        cells.push_back(c) ; volume++ ;
+  if (core_is_dead) return main_proc_t<method,Birth,Death,1>(exit_size,save_size,max_time,wait_time) ;
+  else return main_proc_t<method,Birth,Death,0>(exit_size,save_size,max_time,wait_time) ;
+}
 
-        ll->n++ ; 
-#ifndef NO_MECHANICS
-        double d=(c.x*c.x+c.y*c.y+c.z*c.z) ; if (d>SQR(ll->rad)) ll->rad=sqrt(d) ;
-        if (ll->rad/ll->rad0>1.05) {
-          ll->reduce_overlap() ;  
-          ll->find_closest() ; 
-          ll->rad0=ll->rad ;
-          ll->n0=ll->n ; 
-        }
-#endif
-      } else { // make a new lesion
-        int x=kn-wx/2+ll->r.x, y=jn-wx/2+ll->r.y, z=in-wx/2+ll->r.z ;
-        if (no_SNPs>0) { 
-          genotypes.push_back(new Genotype(genotypes[cells[n].gen],cells[n].gen,no_SNPs)) ;
-          lesions.push_back(new Lesion(cells.size(),genotypes.size()-1,x,y,z)) ;
-        } else {
-          genotypes[cells[n].gen]->number++ ; 
-          lesions.push_back(new Lesion(cells.size(),cells[n].gen,x,y,z)) ;
-        }        
-#ifndef NO_MECHANICS
-        lesions[lesions.size()-1]->find_closest() ; 
-#endif
-      }
-// BOTH_MUTATE          
-      no_SNPs=poisson() ; // old cell mutates
-      if (no_SNPs>0) { 
-        genotypes[cells[n].gen]->number-- ; 
-        int pn=genotypes.size() ; genotypes.push_back(new Genotype(genotypes[cells[n].gen],cells[n].gen,no_SNPs)) ;
-        cells[n].gen=genotypes.size()-1 ;
-        if (genotypes[cells[n].gen]->number<=0) { 
-          delete genotypes[cells[n].gen] ; genotypes[cells[n].gen]=NULL ; 
-        }
-      }
-    }
-  
-#ifdef CORE_IS_DEAD
-    if (ll->no_free_sites(k,j,i)==0) { // remove cell from the core but leave p[i,j,k] set
-      genotypes[cells[n].gen]->number-- ; if (genotypes[cells[n].gen]->number<=0) { 
-        delete genotypes[cells[n].gen] ; genotypes[cells[n].gen]=NULL ; 
-      }
-      cells[n]=cells[cells.size()-1] ; cells.pop_back() ; 
-    }
-#endif
+template <int method, class Birth>
+int main_proc_d(int exit_size, int save_size, double max_time, double wait_time)
+{
+  if (death_rule==D_SURFACE) return main_proc_c<method,Birth,SurfaceDeath>(exit_size,save_size,max_time,wait_time) ;
+  else return main_proc_c<method,Birth,VolumeDeath>(exit_size,save_size,max_time,wait_time) ;
+}
 
-// now we implement death
-    if (mode==1) {
-#ifdef PUSHING
-      ll->p[i][j][k]=-1 ;
-#else
-      ll->p[i*wx+j]->unset(k) ;
-#endif
-      ll->n-- ; 
-//      if (ll->n<0) err("ll->n<0") ;
-#ifndef NO_MECHANICS
-      if (ll->n>1000 && 1.*ll->n/ll->n0<0.9) { // recalculate radius
-        ll->rad=0 ; 
-        for (i=0;i<wx;i++) for (j=0;j<wx;j++) for (k=0;k<wx;k++) {
-#ifdef PUSHING
-          double d=SQR(i-wx/2)+SQR(j-wx/2)+SQR(k-wx/2) ; if (ll->p[i][j][k]!=-1 && d>SQR(ll->rad)) ll->rad=sqrt(d) ; 
-#else
-          double d=SQR(i-wx/2)+SQR(j-wx/2)+SQR(k-wx/2) ; if (ll->p[i*wx+j]->is_set(k) && d>SQR(ll->rad)) ll->rad=sqrt(d) ; 
-#endif
-        }
-        ll->rad0=ll->rad ; ll->n0=ll->n ;
-      }
-#endif
-      if (ll->n==0) {
-        int nn=cells[n].lesion ;
-//        if (ll!=lesions[nn]) err("ll!") ;
-        ll=NULL ; 
-        delete lesions[nn] ; 
-        if (nn!=lesions.size()-1) { // move lesion to a different index, and change cells->lesion correspondingly
-          for (i=0;i<cells.size();i++) if (cells[i].lesion==lesions.size()-1) cells[i].lesion=nn ;
-          lesions[nn]=lesions[lesions.size()-1] ; 
-        }        
-        lesions.pop_back() ;        
-#ifndef NO_MECHANICS
-        for (i=0;i<lesions.size();i++) {
-          lesions[i]->find_closest() ;  
-        }
-#endif 
-      }
-      genotypes[cells[n].gen]->number-- ; if (genotypes[cells[n].gen]->number<=0) { 
-        delete genotypes[cells[n].gen] ; genotypes[cells[n].gen]=NULL ; 
-      }
-      if (n!=cells.size()-1) { 
-        cells[n]=cells[cells.size()-1] ;
+template <int method>
+int main_proc_b(int exit_size, int save_size, double max_time, double wait_time)
+{
 #ifdef PUSHING
-        Lesion *ll2=lesions[cells[n].lesion] ;
-        int ii=cells[n].z+ll2->wx/2, jj=cells[n].y+ll2->wx/2, kk=cells[n].x+ll2->wx/2 ;
-        ll2->p[ii][jj][kk]=n ;
-#endif
-      }
-      cells.pop_back() ; volume-- ;
-      //if (lesions.size()==0) err("N=",int(cells.size())) ;
-    }
-
-    if (need_wx_update && ll!=NULL) ll->update_wx() ;    
-      
-#ifdef CORE_IS_DEAD
-    ntot=volume ;
+  return main_proc_d<method,PushBirth>(exit_size,save_size,max_time,wait_time) ;
 #else
-    ntot=cells.size() ;
+  if (birth_rule==B_CONST) return main_proc_d<method,ConstBirth>(exit_size,save_size,max_time,wait_time) ;
+  else return main_proc_d<method,LinearBirth>(exit_size,save_size,max_time,wait_time) ;
 #endif
+}
 
-    if (wait_time>0 && tt>tt_old+wait_time) { tt_old=tt ; save_data(); }
-    if (save_size>1 && ntot>=save_size) { save_size*=2 ; save_data() ; }
-
-    if (cells.size()==0) return 1 ; 
-    if (max_time>0 && tt>max_time) return 3 ;
-    if (exit_size>0 && ntot>=exit_size) return 4 ;
-
+int main_proc(int exit_size, int save_size, double max_time, double wait_time)
+{
+  switch (method) {
+    case M_FASTER_KMC: return main_proc_b<M_FASTER_KMC>(exit_size,save_size,max_time,wait_time) ;
+    case M_GILLESPIE: return main_proc_b<M_GILLESPIE>(exit_size,save_size,max_time,wait_time) ;
+    default: return main_proc_b<M_NORMAL>(exit_size,save_size,max_time,wait_time) ;
   }
-
 }
-
-#endif // FASTER_KMC or GILLESPIE